@@ -0,0 +1,139 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <cstdio>
+#include <stdexcept>
+#include "checkpoint.h"
+#include "statefile.h"
+
+using namespace cv;
+
+void writeCheckpoint(const std::string& filename, const stackProgress& progress) {
+  binaryArchiveWriter archive;
+  FileStorage fs(".yml", FileStorage::WRITE | FileStorage::MEMORY);
+  fs << "imageCount" << (int)progress.done.size();
+  // The fingerprint is stored as an array of bytes, which (unlike a YAML
+  // string) can hold anything.
+  fs << "fingerprint" << archive.add(Mat(1, progress.fingerprint.size(), CV_8U,
+                                         (void*)progress.fingerprint.data()));
+  // Sums and normalizations as pairs of array indices.
+  fs << "sums" << "[";
+  for (size_t i = 0; i < progress.sums.size(); i++)
+    fs << "[:" << archive.add(progress.sums[i])
+       << archive.add(progress.normalizations[i]) << "]";
+  fs << "]";
+  // Processed images as pairs of (image index, shifts array index); the
+  // latter is -1 if there are no shifts.
+  fs << "done" << "[";
+  for (size_t i = 0; i < progress.done.size(); i++) {
+    if (!progress.done[i])
+      continue;
+    const bool haveShifts = i < progress.shifts.size() && !progress.shifts[i].empty();
+    fs << "[:" << (int)i << (haveShifts ? archive.add(progress.shifts[i]) : -1) << "]";
+  }
+  fs << "]";
+
+  const std::string tmp = filename + ".tmp";
+  try {
+    archive.write(tmp, fs.releaseAndGetString());
+  }
+  catch (...) {
+    std::remove(tmp.c_str());
+    throw;
+  }
+  if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+    std::remove(tmp.c_str());
+    throw std::runtime_error("can not replace checkpoint '" + filename + "'");
+  }
+}
+
+
+stackProgress readCheckpoint(const std::string& filename) {
+  binaryArchiveReader archive(filename);
+  FileStorage fs(archive.metadata(), FileStorage::READ | FileStorage::MEMORY);
+
+  stackProgress progress;
+  const int imageCount = fs["imageCount"];
+  progress.done.resize(imageCount, false);
+  progress.shifts.resize(imageCount);
+  if (fs["fingerprint"].isInt()) {
+    const Mat bytes = archive.array(fs["fingerprint"]);
+    progress.fingerprint.assign(bytes.ptr<char>(), bytes.total());
+  }
+  // Data are copied out of the mapping because they will be modified (the
+  // sums) or must outlive the archive (the shifts).
+  for (const auto& entry : fs["sums"]) {
+    progress.sums.push_back(archive.array(entry[0]).clone());
+    progress.normalizations.push_back(archive.array(entry[1]).clone());
+  }
+  for (const auto& entry : fs["done"]) {
+    const int index = entry[0];
+    const int shiftsIndex = entry[1];
+    if (index < 0 || index >= imageCount)
+      throw std::runtime_error("corrupt checkpoint '" + filename + "'");
+    progress.done[index] = true;
+    if (shiftsIndex >= 0)
+      progress.shifts[index] = archive.array(shiftsIndex).clone();
+  }
+  return progress;
+}
+
+
+checkpointWriter::checkpointWriter(const std::string& filename_, int intervalSeconds) :
+  filename(filename_), interval(intervalSeconds),
+  last(std::chrono::steady_clock::now()) {}
+
+
+checkpointWriter::~checkpointWriter() {
+  wait();
+}
+
+
+bool checkpointWriter::due() const {
+  return std::chrono::steady_clock::now() - last >= interval;
+}
+
+
+void checkpointWriter::submit(stackProgress snapshot) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (busy)
+      return;
+    busy = true;
+  }
+  wait();
+  last = std::chrono::steady_clock::now();
+  writer = std::thread([this](stackProgress snapshot) {
+    try {
+      writeCheckpoint(filename, snapshot);
+    }
+    catch (std::exception& e) {
+      // A failed checkpoint should not bring down the run itself.
+      std::cerr << "\nWARNING: checkpoint not written: " << e.what() << "\n";
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    busy = false;
+  }, std::move(snapshot));
+}
+
+
+void checkpointWriter::wait() {
+  if (writer.joinable())
+    writer.join();
+}
@@ -0,0 +1,76 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <opencv2/core/core.hpp>
+
+// Partial results of stack(): which images have been processed, their
+// dedistortion shifts (if computed) and the accumulated sums (one for each
+// output). The fingerprint describes the run (see stack()); a checkpoint is
+// only resumed by a run with the same fingerprint.
+struct stackProgress {
+  std::string fingerprint;
+  std::vector<bool> done;
+  std::vector<cv::Mat1f> shifts;
+  std::vector<cv::Mat> sums;
+  std::vector<cv::Mat> normalizations;
+};
+
+// Checkpoints are binary archives (see statefile.h). They are first written
+// to a temporary file that is renamed over the previous checkpoint when
+// complete, so an interrupted write never destroys the last good one.
+void writeCheckpoint(const std::string& filename, const stackProgress& progress);
+// Throws std::runtime_error if the file can not be read.
+stackProgress readCheckpoint(const std::string& filename);
+
+
+// Writes checkpoints at regular intervals in a background thread, so that
+// the processing pipeline does not wait for the disk.
+class checkpointWriter {
+public:
+  checkpointWriter(const std::string& filename, int intervalSeconds);
+  ~checkpointWriter();
+  checkpointWriter(const checkpointWriter&) = delete;
+  checkpointWriter& operator=(const checkpointWriter&) = delete;
+
+  // Whether the interval has elapsed since the last checkpoint.
+  bool due() const;
+  // Starts writing the snapshot, unless the previous one is still being
+  // written, in which case this checkpoint is skipped. The snapshot must
+  // not share image data that is still being modified.
+  void submit(stackProgress snapshot);
+
+private:
+  void wait();
+
+  std::string filename;
+  std::chrono::seconds interval;
+  std::chrono::steady_clock::time_point last;
+  std::thread writer;
+  std::mutex mutex;
+  bool busy = false;
+};
+
+#endif // CHECKPOINT_H
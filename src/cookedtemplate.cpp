@@ -26,11 +26,12 @@
 using namespace cv;
 
 
-cookedXcor::cookedXcor(const Mat& _templ, Size _corrsize, int _ctype) :
-  ctype(_ctype), maxDepth(CV_64F), corrsize(_corrsize)
+cookedXcor::cookedXcor(const Mat& _templ, Size _corrsize, int _ctype,
+                       int spectralDepth, const xcorOptions& options) :
+  ctype(_ctype), maxDepth(spectralDepth), corrsize(_corrsize)
 {
-    const double blockScale = 4.5;
-    const int minBlockSize = 256;
+    const double blockScale = options.blockScale;
+    const int minBlockSize = options.minBlockSize;
     std::vector<uchar> buf;
 
     Mat templ = _templ;
@@ -40,6 +41,14 @@ cookedXcor::cookedXcor(const Mat& _templ, Size _corrsize, int _ctype) :
 
     CV_Assert( templ.dims <= 2 );
     CV_Assert( tdepth == CV_32F );
+    CV_Assert( maxDepth == CV_32F || maxDepth == CV_64F );
+
+    // The direct engine only handles single channel correlation; the
+    // spectra are still computed for images that it can't handle (see
+    // xcor()).
+    if( options.engine == xcorOptions::engineType::Direct && tcn == 1 &&
+        _ctype == CV_32F )
+        spatialTempl = templ.clone();
 
     blocksize.width = cvRound(templ.cols*blockScale);
     blocksize.width = std::max( blocksize.width, minBlockSize - templ.cols + 1 );
@@ -95,12 +104,13 @@ cookedXcor::cookedXcor(const Mat& _templ, Size _corrsize, int _ctype) :
 }
 
 
-void cookedXcor::xcor(const Mat& img, Mat& corr) const
+void cookedXcor::xcor(const Mat& img, Mat& corr, xcorWorkspace& workspace) const
 {
     Point anchor(0, 0);
     const double delta = 0;
     int borderType = 0;
-    std::vector<uchar> buf;
+    Mat& dftImg = workspace.dftImg;
+    std::vector<uchar>& buf = workspace.buf;
 
     int depth = img.depth(), cn = img.channels();
     int cdepth = CV_MAT_DEPTH(ctype), ccn = CV_MAT_CN(ctype);
@@ -112,9 +122,21 @@ void cookedXcor::xcor(const Mat& img, Mat& corr) const
                corrsize.width <= img.cols + templsize.width - 1 );
     CV_Assert( ccn == 1 || delta == 0 );
 
+    // The direct engine needs the whole search area within the image.
+    if( !spatialTempl.empty() && cn == 1 &&
+        corrsize.height + templsize.height - 1 <= img.rows &&
+        corrsize.width + templsize.width - 1 <= img.cols )
+    {
+        if( maxDepth == CV_32F )
+            directXcor<float>(img, corr, workspace.dftImg);
+        else
+            directXcor<double>(img, corr, workspace.dftImg);
+        return;
+    }
+
     corr.create(corrsize, ctype);
 
-    Mat dftImg( dftsize, maxDepth );
+    dftImg.create( dftsize, maxDepth );
 
     int bufSize = 0;
     if( tcn > 1 && tdepth != maxDepth )
@@ -127,7 +149,8 @@ void cookedXcor::xcor(const Mat& img, Mat& corr) const
     if( (ccn > 1 || cn > 1) && cdepth != maxDepth )
         bufSize = std::max( bufSize, blocksize.width*blocksize.height*CV_ELEM_SIZE(cdepth));
 
-    buf.resize(bufSize);
+    if( buf.size() < (size_t)bufSize )
+        buf.resize(bufSize);
 
     int tileCountX = (corr.cols + blocksize.width - 1)/blocksize.width;
     int tileCountY = (corr.rows + blocksize.height - 1)/blocksize.height;
@@ -221,7 +244,36 @@ void cookedXcor::xcor(const Mat& img, Mat& corr) const
 }
 
 
-cookedTemplate::cookedTemplate(InputArray _templ, Size searchSize)
+// corr(y, x) = sum over (ty, tx) of templ(ty, tx) img(y + ty, x + tx),
+// accumulated one template pixel at a time as a scaled row of the image,
+// so that the innermost loop runs over contiguous memory and vectorizes.
+template <typename acc_t>
+void cookedXcor::directXcor(const Mat& img, Mat& corr, Mat& acc) const
+{
+    acc.create(corrsize, maxDepth);
+    acc = Scalar::all(0);
+    for( int y = 0; y < corrsize.height; y++ )
+    {
+        acc_t* a = acc.ptr<acc_t>(y);
+        for( int ty = 0; ty < templsize.height; ty++ )
+        {
+            const float* i = img.ptr<float>(y + ty);
+            const float* t = spatialTempl.ptr<float>(ty);
+            for( int tx = 0; tx < templsize.width; tx++ )
+            {
+                const acc_t w = t[tx];
+                const float* row = i + tx;
+                for( int x = 0; x < corrsize.width; x++ )
+                    a[x] += w * row[x];
+            }
+        }
+    }
+    acc.convertTo(corr, CV_32F);
+}
+
+
+cookedTemplate::cookedTemplate(InputArray _templ, Size searchSize,
+                               int spectralDepth, const xcorOptions& options)
 {
   Mat templ = _templ.getMat();
   CV_Assert(templ.cols <= searchSize.width &&
@@ -231,11 +283,12 @@ cookedTemplate::cookedTemplate(InputArray _templ, Size searchSize)
 
   templType = templ.type();
   corrSize = Size(searchSize.width - templ.cols + 1, searchSize.height - templ.rows + 1);
-  cxc = cookedXcor(templ, corrSize, CV_32F);
+  cxc = cookedXcor(templ, corrSize, CV_32F, spectralDepth, options);
 }
 
 
-void cookedTemplate::match(InputArray _img, OutputArray _result) const
+void cookedTemplate::match(InputArray _img, OutputArray _result,
+                           xcorWorkspace& workspace) const
 {
   Mat img = _img.getMat();
   CV_Assert(img.depth() == CV_32F);
@@ -243,5 +296,39 @@ void cookedTemplate::match(InputArray _img, OutputArray _result) const
 
   _result.create(corrSize, CV_32F);
   Mat result = _result.getMat();
-  cxc.xcor(img, result);
+  cxc.xcor(img, result, workspace);
+}
+
+
+cookedReference::cookedReference(const Mat& img, Size _templSize) :
+  templSize(_templSize)
+{
+  CV_Assert(img.type() == CV_32F);
+  CV_Assert(templSize.width <= img.cols && templSize.height <= img.rows);
+
+  corrSize = Size(img.cols - templSize.width + 1, img.rows - templSize.height + 1);
+  // The transform is circular; as long as it is at least as large as the
+  // image, correlations at all positions within corrSize are free of
+  // wrap-around.
+  dftSize = Size(getOptimalDFTSize(img.cols), getOptimalDFTSize(img.rows));
+
+  dftImg = Mat::zeros(dftSize, CV_64F);
+  img.convertTo(dftImg(Rect(Point(0, 0), img.size())), CV_64F);
+  dft(dftImg, dftImg, 0, img.rows);
+}
+
+
+void cookedReference::match(const Mat& templ, Mat& result, Mat& workspace) const
+{
+  CV_Assert(templ.type() == CV_32F);
+  CV_Assert(templ.size() == templSize);
+
+  workspace.create(dftSize, CV_64F);
+  workspace = Scalar::all(0);
+  templ.convertTo(workspace(Rect(Point(0, 0), templSize)), CV_64F);
+  dft(workspace, workspace, 0, templSize.height);
+  // corr(p) = sum_q img(p+q) templ(q)  <=>  DFT(corr) = DFT(img) conj(DFT(templ))
+  mulSpectrums(dftImg, workspace, workspace, 0, true);
+  dft(workspace, workspace, DFT_INVERSE + DFT_SCALE, corrSize.height);
+  workspace(Rect(Point(0, 0), corrSize)).convertTo(result, CV_32F);
 }
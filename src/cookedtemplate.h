@@ -19,16 +19,48 @@
 #ifndef COOKEDTEMPLATE_H
 #define COOKEDTEMPLATE_H
 
+#include <vector>
 #include <opencv2/core/core.hpp>
 
+// Scratch memory for cookedXcor::xcor(). A thread that keeps reusing the
+// same workspace (for templates of the same size) does not allocate any
+// memory after the first call.
+struct xcorWorkspace
+{
+  cv::Mat dftImg;
+  std::vector<uchar> buf;
+};
+
+
+// How cookedXcor computes the correlation: with block DFTs (the block size
+// depends on blockScale and minBlockSize, see the source) or directly in
+// the spatial domain, which can be faster for small searches. The best
+// choice depends on the geometry and the machine; see xcorWisdom.
+struct xcorOptions
+{
+  enum class engineType { FFT, Direct } engine = engineType::FFT;
+  double blockScale = 4.5;
+  int minBlockSize = 256;
+};
+
+
 class cookedXcor
 {
 public:
   cookedXcor() {};
-  cookedXcor(const cv::Mat& _templ, cv::Size corrsize, int ctype);
-  void xcor(const cv::Mat& img, cv::Mat& corr) const;
+  // The correlation is computed with spectra of the given depth: CV_64F
+  // (as in OpenCV's matchTemplate()) or CV_32F, which needs half the memory
+  // and is faster, but less precise. The direct engine accumulates in the
+  // same depth.
+  cookedXcor(const cv::Mat& _templ, cv::Size corrsize, int ctype,
+             int spectralDepth = CV_64F,
+             const xcorOptions& options = xcorOptions());
+  void xcor(const cv::Mat& img, cv::Mat& corr, xcorWorkspace& workspace) const;
 
 private:
+  template <typename acc_t>
+  void directXcor(const cv::Mat& img, cv::Mat& corr, cv::Mat& acc) const;
+
   int ctype;
   int maxDepth;
   int tdepth;
@@ -38,14 +70,19 @@ private:
   cv::Size blocksize;
   cv::Size dftsize;
   cv::Mat dftTempl;
+  // Only for the direct engine.
+  cv::Mat spatialTempl;
 };
 
 
 class cookedTemplate
 {
 public:
-  cookedTemplate(cv::InputArray _templ, cv::Size searchSize);
-  void match(cv::InputArray _img, cv::OutputArray _result) const;
+  cookedTemplate(cv::InputArray _templ, cv::Size searchSize,
+                 int spectralDepth = CV_64F,
+                 const xcorOptions& options = xcorOptions());
+  void match(cv::InputArray _img, cv::OutputArray _result,
+             xcorWorkspace& workspace) const;
 
 private:
   int templType;
@@ -53,4 +90,23 @@ private:
   cookedXcor cxc;
 };
 
+
+// The opposite of cookedTemplate: the image that is searched is fixed and
+// the templates vary. The DFT of the image is computed in advance; matching
+// a template then takes one forward and one inverse transform. match() may
+// be called from several threads at once, each with its own workspace.
+class cookedReference
+{
+public:
+  cookedReference(const cv::Mat& img, cv::Size templSize);
+  // Equivalent to matchTemplate(img, templ, result, TM_CCORR).
+  void match(const cv::Mat& templ, cv::Mat& result, cv::Mat& workspace) const;
+
+private:
+  cv::Size templSize;
+  cv::Size corrSize;
+  cv::Size dftSize;
+  cv::Mat dftImg;
+};
+
 #endif // COOKEDTEMPLATE_H
@@ -19,8 +19,22 @@
 #include <iostream>
 #include <algorithm>
 #include <tuple>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <sstream>
 #include "imageops.h"
 #include "dedistort.h"
+#include "framesource.h"
+#include "pipeline.h"
+#include "checkpoint.h"
+#include "tiledaccumulator.h"
+#include "xcorwisdom.h"
 
 using namespace cv;
 
@@ -58,7 +72,8 @@ patchCollection selectPointsHex(const registrationParams& params,
          x += xydiff) {
       Rect relativeSearchArea(Point(x-maxmb, y-maxmb), Point(x+boxsize+maxmb, y+boxsize+maxmb));
       imagePatch p(refimg, originx + x, originy + y, boxsize,
-                   relativeSearchArea + patchCreationArea.tl());
+                   relativeSearchArea + patchCreationArea.tl(),
+                   params.spectralDepth());
       patches.push_back(p);
     }
   }
@@ -66,35 +81,74 @@ patchCollection selectPointsHex(const registrationParams& params,
 }
 
 
+void patchMatcher::setImage(const Mat1f& img)
+{
+  multiply(img, img, imgSquared);
+  integral(imgSquared, imgSqIntegral, CV_64F);
+}
+
+
 Mat1f patchMatcher::match(const Mat1f& img,
                           const Rect imgRect,
                           const Rect validRect,
                           const imagePatch& patch,
                           const float multiplier)
 {
-  Mat1f roi(img, patch.searchArea - imgRect.tl());
-  patch.cookedMask.match(roi.mul(roi), roisq);
-  patch.cookedTmpl.match(roi, cor);
-
+  CV_Assert(imgSqIntegral.rows == img.rows + 1 && imgSqIntegral.cols == img.cols + 1);
+  const Rect roiRect = patch.searchArea - imgRect.tl();
+  const Size box = patch.image.size();
+  const Size corrSize(roiRect.width - box.width + 1, roiRect.height - box.height + 1);
+
+  Mat1f roi(img, roiRect);
+  patch.cookedTmpl().match(roi, cor, xcor);
+
+  // The sum of squares of the image under the patch at each position, from
+  // four corners of the box in the summed-area table.
+  auto corner = [&](const int dx, const int dy) {
+    return imgSqIntegral(Rect(roiRect.tl() + Point(dx, dy), corrSize));
+  };
+  subtract(corner(box.width, box.height), corner(box.width, 0), boxSum);
+  subtract(boxSum, corner(0, box.height), boxSum);
+  add(boxSum, corner(0, 0), boxSum);
+  boxSum.convertTo(roisq, CV_32F);
+
+  // result = roisq - 2*multiplier*cor + multiplier^2*patchsq, evaluated in
+  // place so that no temporaries are allocated.
+  scaleAdd(cor, -2*multiplier, roisq, result);
   if (patch.searchAreaWithin(validRect))
   {
     // Search area is completely within the image. This is easy.
-    return roisq - 2*multiplier*cor + pow(multiplier, 2)*patch.sqsum;
+    result += pow(multiplier, 2)*patch.sqsum;
+    return result;
   }
   else {
     // Search area is only partially within the image. We need some more
     // computations to handle this.
+    const Rect valid = (patch.searchArea & validRect) - patch.searchArea.tl();
     if (imgValidMask.size() != patch.searchArea.size())
       imgValidMask = Mat::zeros(patch.searchArea.size(), CV_32F);
     else
       imgValidMask.setTo(0);
 
-    imgValidMask((patch.searchArea & validRect) - patch.searchArea.tl()) = 1;
-    patch.cookedSquare.match(imgValidMask, patchsq);
-    patch.cookedMask.match(imgValidMask, normalization);
-
-    Mat1f unn_match = roisq - 2*multiplier*cor + pow(multiplier, 2)*patchsq;
-    return unn_match.mul(1/normalization);
+    imgValidMask(valid) = 1;
+    patch.cookedSquare().match(imgValidMask, patchsq, xcor);
+
+    // The number of valid pixels under the patch is the product of the
+    // numbers of valid columns and rows that it covers.
+    validCols.create(1, corrSize.width);
+    validRows.create(corrSize.height, 1);
+    for (int x = 0; x < corrSize.width; x++)
+      validCols(0, x) = std::max(0, std::min(x + box.width, valid.br().x) - std::max(x, valid.x));
+    for (int y = 0; y < corrSize.height; y++)
+      validRows(y, 0) = std::max(0, std::min(y + box.height, valid.br().y) - std::max(y, valid.y));
+    normalization.create(corrSize);
+    for (int y = 0; y < corrSize.height; y++)
+      for (int x = 0; x < corrSize.width; x++)
+        normalization(y, x) = validRows(y, 0) * validCols(0, x);
+
+    scaleAdd(patchsq, pow(multiplier, 2), result, result);
+    divide(result, normalization, result);
+    return result;
   }
 }
 
@@ -162,6 +216,24 @@ Point2f quadraticFit::smallerEigVec() const
 }
 
 
+Point2f subpixelCorrection(const Mat& match, const Point coarseMin) {
+  quadraticFit qf(match, coarseMin);
+  Point2f subShift = qf.minimum();
+
+  if (abs(subShift.x) > 0.5 || abs(subShift.y) > 0.5) {
+    // Subpixel correction larger than 0.5 px indicates poor fit. Project
+    // out the direction corresponding to the smaller eigenvalue and see
+    // if that helps.
+    subShift = subShift.dot(qf.largerEigVec()) * qf.largerEigVec();
+
+    // Give up if the shift is still larger than 0.5 px.
+    if (abs(subShift.x) > 0.5 || abs(subShift.y) > 0.5)
+      subShift = Point2f(0, 0);
+  }
+  return subShift;
+}
+
+
 // Patch quality estimation
 //
 // Patch quality is assessed as follows: each patch is matched against its
@@ -192,6 +264,7 @@ patchCollection filterPatchesByQuality(const patchCollection& patches,
   refimgRect += Point(left, top);
 
   patchMatcher matcher;
+  matcher.setImage(paddedRefimg);
   for (auto& patch : patches) {
     // perform the matching
     Mat1f match = matcher.match(paddedRefimg, paddedRect, refimgRect, patch, 1.0);
@@ -229,75 +302,282 @@ Mat drawPoints(const Mat& img, const patchCollection& patches) {
 }
 
 
+// Matches a single patch and returns false if the match is rejected;
+// otherwise, shift is set to the subpixel shift of the patch.
+static bool matchPatch(const Mat& img,
+                       const Rect imgRect,
+                       const Rect validRect,
+                       const imagePatch& patch,
+                       const float multiplier,
+                       patchMatcher& matcher,
+                       Point2f& shift) {
+  Mat1f match = matcher.match(img, imgRect, validRect, patch, multiplier);
+  Point coarseMin;
+  minMaxLoc(match, NULL, NULL, &coarseMin);
+
+  // Check whether the match was located in the outer 1px buffer zone
+  // (i.e., whether it has exceeded the given maxmove). This usually
+  // indicates an extremely questionable match and we rather leave
+  // the shift at (0,0) for this point. We also reject really pathological
+  // cases (like a whole matrix of NaNs) which are indicated by minMaxLoc
+  // reporting the minimum at (-1,-1).
+  if (!(coarseMin.x > 0 && coarseMin.y > 0 &&
+        coarseMin.x < match.cols - 1 && coarseMin.y < match.rows - 1))
+    return false;
+
+  // The coarse estimate seems OK; do subpixel correction now.
+  shift = coarseMin;
+  shift += subpixelCorrection(match, coarseMin);
+
+  // The shift is reported relative to the top left corner in the
+  // image. Change it so that it refers to the center.
+  shift -= Point2f(patch.matchShiftx(), patch.matchShifty());
+  return true;
+}
+
+
+// Rectangle in coordinates downsampled by factor that contains all pixels
+// of rect.
+static Rect downsampledCover(const Rect rect, const int factor) {
+  const Point tl(cvFloor(rect.x / (double)factor), cvFloor(rect.y / (double)factor));
+  const Point br(cvCeil(rect.br().x / (double)factor), cvCeil(rect.br().y / (double)factor));
+  return Rect(tl, br);
+}
+
+
+// Rectangle in coordinates downsampled by factor that only contains pixels
+// completely within rect.
+static Rect downsampledInterior(const Rect rect, const int factor) {
+  const Point tl(cvCeil(rect.x / (double)factor), cvCeil(rect.y / (double)factor));
+  const Point br(cvFloor(rect.br().x / (double)factor), cvFloor(rect.br().y / (double)factor));
+  return Rect(tl, br);
+}
+
+
+patchPyramid::patchPyramid(const registrationContext& context, const int levels_) :
+  levels(levels_), factor(1 << levels_)
+{
+  Mat coarseRefimg = context.refimg();
+  for (int i = 0; i < levels; i++)
+    pyrDown(coarseRefimg, coarseRefimg);
+  const int boxsize = context.boxsize();
+  const int coarseBoxsize = boxsize / factor;
+  // The coarse estimate is accurate to about one coarse pixel.
+  const int radius = 2*factor;
+
+  coarse.patchCreationArea = downsampledCover(context.patches().patchCreationArea, factor);
+  fine.patchCreationArea = context.patches().patchCreationArea;
+  for (const auto& patch : context.patches()) {
+    const Rect coarseSearch = downsampledCover(patch.searchArea, factor);
+    const int x = std::min(cvRound(patch.x / (double)factor),
+                           coarseSearch.br().x - coarseBoxsize);
+    const int y = std::min(cvRound(patch.y / (double)factor),
+                           coarseSearch.br().y - coarseBoxsize);
+    coarse.push_back(imagePatch(coarseRefimg, x, y, coarseBoxsize, coarseSearch,
+                                patch.spectralDepth()));
+
+    // The window (with the 1px safety border) is moved into place for each
+    // match; copies of the patch share its cooked templates.
+    const int window = std::min(boxsize + 2*(radius + 1),
+                                std::min(patch.searchArea.width, patch.searchArea.height));
+    fine.push_back(imagePatch(context.refimg(), imagePatchPosition(patch),
+                              boxsize, patch.spectralDepth()));
+    fine.back().searchArea = Rect(patch.searchArea.tl(), Size(window, window));
+  }
+}
+
+
 Mat1f findShifts(const Mat& img,
                  const Rect imgRect,
                  const Rect validRect,
                  const patchCollection& patches,
                  const float multiplier,
-                 patchMatcher& matcher) {
+                 dedistortionWorkspace& workspace,
+                 const patchPyramid* pyramid) {
   Mat1f shifts(patches.size(), 2);
   int patchNr = -1;
+  workspace.matcher.setImage(img);
+
+  // The downsampled image for the coarse step; imgRect is aligned to the
+  // downsampling factor (see dedistortionShifts()).
+  Rect coarseImgRect, coarseValidRect;
+  if (pyramid) {
+    workspace.pyramidImgs.resize(pyramid->levels);
+    for (int i = 0; i < pyramid->levels; i++)
+      pyrDown(i == 0 ? img : workspace.pyramidImgs[i-1], workspace.pyramidImgs[i]);
+    coarseImgRect = Rect(imgRect.tl() / pyramid->factor,
+                         workspace.pyramidImgs.back().size());
+    coarseValidRect = downsampledInterior(validRect, pyramid->factor);
+    workspace.coarseMatcher.setImage(workspace.pyramidImgs.back());
+  }
 
   for (auto& patch : patches) {
     patchNr++;
+    Point2f shift(0, 0);
     if (!patch.searchAreaOverlaps(validRect)) {
-      shifts.at<float>(patchNr, 0) = 0;
-      shifts.at<float>(patchNr, 1) = 0;
-      continue;
+      // nothing to match; the shift stays at (0,0)
     }
-
-    Mat1f match = matcher.match(img, imgRect, validRect, patch, multiplier);
-    Point coarseMin;
-    Point2f subPixelMin(0,0);
-    minMaxLoc(match, NULL, NULL, &coarseMin);
-
-    // Check whether the match was located in the outer 1px buffer zone
-    // (i.e., whether it has exceeded the given maxmove). This usually
-    // indicates an extremely questionable match and we rather leave
-    // the shift at (0,0) for this point. We also reject really pathological
-    // cases (like a whole matrix of NaNs) which are indicated by minMaxLoc
-    // reporting the minimum at (-1,-1).
-    if (coarseMin.x > 0 && coarseMin.y > 0 &&
-      coarseMin.x < match.cols - 1 && coarseMin.y < match.rows - 1) {
-      // The coarse estimate seems OK; do subpixel correction now.
-      subPixelMin = coarseMin;
-      quadraticFit qf(match, coarseMin);
-      Point2f subShift = qf.minimum();
-
-      if (abs(subShift.x) > 0.5 || abs(subShift.y) > 0.5) {
-        // Subpixel correction larger than 0.5 px indicates poor fit. Project
-        // out the direction corresponding to the smaller eigenvalue and see
-        // if that helps.
-        subShift = subShift.dot(qf.largerEigVec()) * qf.largerEigVec();
-
-        // Give up if the shift is still larger than 0.5 px.
-        if (abs(subShift.x) > 0.5 || abs(subShift.y) > 0.5)
-          subShift = Point2f(0, 0);
+    else if (!pyramid) {
+      if (!matchPatch(img, imgRect, validRect, patch, multiplier,
+                      workspace.matcher, shift))
+        shift = Point2f(0, 0);
+    }
+    else {
+      // Coarse step over the whole search area, then refinement in a window
+      // around the estimate. The window must stay within the search area,
+      // so that the maxmove limit is respected.
+      const imagePatch& coarsePatch = pyramid->coarse.at(patchNr);
+      Point2f coarseShift;
+      if (coarsePatch.searchAreaOverlaps(coarseValidRect) &&
+          matchPatch(workspace.pyramidImgs.back(), coarseImgRect, coarseValidRect,
+                     coarsePatch, multiplier, workspace.coarseMatcher, coarseShift)) {
+        imagePatch window = pyramid->fine.at(patchNr);
+        const Point estimate(cvRound(coarseShift.x * pyramid->factor),
+                             cvRound(coarseShift.y * pyramid->factor));
+        const Point center = Point((int)patch.x, (int)patch.y) + estimate +
+                             Point(patch.image.cols, patch.image.rows) / 2;
+        Point tl = center - Point(window.searchArea.width, window.searchArea.height) / 2;
+        tl.x = std::min(std::max(tl.x, patch.searchArea.x),
+                        patch.searchArea.br().x - window.searchArea.width);
+        tl.y = std::min(std::max(tl.y, patch.searchArea.y),
+                        patch.searchArea.br().y - window.searchArea.height);
+        window.searchArea = Rect(tl, window.searchArea.size());
+        if (!window.searchAreaOverlaps(validRect) ||
+            !matchPatch(img, imgRect, validRect, window, multiplier,
+                        workspace.matcher, shift))
+          shift = Point2f(0, 0);
       }
-      subPixelMin += subShift;
-
-      // The shift is reported relative to the top left corner in the
-      // image. Change it so that it refers to the center.
-      subPixelMin -= Point2f(patch.matchShiftx(), patch.matchShifty());
     }
-    shifts.at<float>(patchNr, 0) = subPixelMin.x;
-    shifts.at<float>(patchNr, 1) = subPixelMin.y;
+    shifts.at<float>(patchNr, 0) = shift.x;
+    shifts.at<float>(patchNr, 1) = shift.y;
   }
   return shifts;
 }
 
 
+// Dedistortion of a single image: finds the shifts of all registration
+// points with respect to the reference image.
+static Mat1f dedistortionShifts(const registrationContext& context,
+                                const imageSumLookup& refsqLookup,
+                                const inputImage& image,
+                                Mat1f img,
+                                dedistortionWorkspace& workspace,
+                                const patchPyramid* pyramid = nullptr)
+{
+  const Mat& refimg = context.refimg();
+
+  // The fractional part of the global shift is applied by interpolation,
+  // so that the search areas only need to accommodate the true distortion;
+  // the integer part is applied below by choosing the regions of interest.
+  const Point globalShift(cvFloor(image.globalShift.x), cvFloor(image.globalShift.y));
+  const Point2f fraction = image.globalShift - Point2f(globalShift);
+  if (fraction != Point2f(0, 0)) {
+    translateImage(img, workspace.translatedImg, fraction, BORDER_REPLICATE);
+    img = workspace.translatedImg;
+  }
+
+  // Image rectangle, expressed in coordinate systems of image itself
+  // and the reference image.
+  Rect img_coordImg(Point(0, 0), img.size());
+  Rect img_coordRefimg = img_coordImg - globalShift;
+
+  // Overlap between img and refimg, again according to both coordinate
+  // systems.
+  Rect overlap_coordRefimg = context.refimgRectangle() & img_coordRefimg;
+  Rect overlap_coordImg = overlap_coordRefimg + globalShift;
+
+  // Isolate the common portions of img and refimg.
+  Mat imgOverlap(img, overlap_coordImg);
+  Mat refimgOverlap(refimg, overlap_coordRefimg);
+
+  // Calculate optimal multiplier for img vs. refimg.
+  const float multiplier = imgOverlap.dot(refimgOverlap) /
+                           refsqLookup.lookup(overlap_coordRefimg);
+
+  // Extract the part of image needed for matching and possibly pad it.
+  Rect totalArea = context.patches().searchAreaForImage(img_coordRefimg);
+  // The coarse step needs the area aligned to the downsampling factor.
+  if (pyramid) {
+    const Rect aligned = downsampledCover(totalArea, pyramid->factor);
+    totalArea = Rect(aligned.tl() * pyramid->factor, aligned.size() * pyramid->factor);
+  }
+  Rect searchOverlap = totalArea & img_coordRefimg;
+  Mat imgSearchRoi(img, searchOverlap + globalShift);
+  if (searchOverlap == totalArea)
+    img = imgSearchRoi;
+  else {
+    Mat& paddedImg = workspace.paddedImg;
+    paddedImg.create(totalArea.size(), img.type());
+    paddedImg.setTo(0);
+    Rect destinationRoi = searchOverlap - totalArea.tl();
+    imgSearchRoi.copyTo(paddedImg(destinationRoi));
+    img = paddedImg;
+  }
+
+  // Find shifts for dedistortion.
+  return findShifts(img, totalArea, searchOverlap, context.patches(),
+                    multiplier, workspace, pyramid);
+}
+
+
+// Everything that a checkpoint depends on: the images, the reference image
+// (by a checksum), the registration points with their parameters and the
+// outputs. Shifts and sums from a run with a different fingerprint can't be
+// reused.
+static std::string checkpointFingerprint(const registrationParams& params,
+                                         const registrationContext& context)
+{
+  std::ostringstream fp;
+  fp.precision(17);
+  fp << "images";
+  for (const auto& image : context.images())
+    fp << "\n" << image.filename << "\n" << image.frame;
+  if (context.refimg.valid()) {
+    const Mat& refimg = context.refimg();
+    const Scalar refimgSum = sum(refimg);
+    fp << "\nrefimg " << refimg.cols << " " << refimg.rows << " " << refimg.type();
+    for (int c = 0; c < refimg.channels(); c++)
+      fp << " " << refimgSum[c];
+    fp << " " << refimg.dot(refimg);
+  }
+  if (context.patches.valid()) {
+    fp << "\npatches " << context.boxsize() << " " << params.maxmove;
+    for (const auto& patch : context.patches())
+      fp << "\n" << patch.x << " " << patch.y << " " << patch.searchArea.x
+         << " " << patch.searchArea.y << " " << patch.searchArea.width
+         << " " << patch.searchArea.height;
+  }
+  // The selection of images and the kind of each sum; file names don't
+  // matter.
+  if (params.stage_stack) {
+    fp << "\noutputs";
+    for (const auto& output : params.outputs())
+      fp << "\n" << output.percent << " " << output.supersampling << " " << output.mono;
+  }
+  return fp.str();
+}
+
+
 // Dedistortion + stacking.
 //
 // These are, in principle, two separate operations. However, to minimize the
 // number of needed image reads (and conversions), they are performed in a
-// single parallelized loop. Parts of the loop specific to dedistortion or
-// stacking are in conditionals to allow the user to request only one operation
-// to be performed.
+// single pass over the images. Stages of the pass that are specific to
+// dedistortion or stacking are in conditionals to allow the user to request
+// only one operation to be performed.
 //
-Mat stack(const registrationParams& params,
-          registrationContext& context,
-          const bool showProgress)
+// The pass is a pipeline: images are decoded by a pool of I/O threads (ahead
+// of the rest), registered, warped and summed up (into a shared
+// tiledAccumulator) by pools of computation threads.
+//
+// Several outputs (params.outputs()) can be stacked in the same pass. Each
+// has its own accumulator; an image is warped once for each supersampling
+// factor that is used by the outputs that include it.
+//
+std::vector<Mat> stack(const registrationParams& params,
+                       registrationContext& context,
+                       const bool showProgress,
+                       bool* stoppedEarly)
 {
   Rect outputRectangle = Rect(Point(0, 0), context.imagesize());
   if (params.crop && context.commonRectangle.valid())
@@ -308,7 +588,10 @@ Mat stack(const registrationParams& params,
   imageSumLookup refsqLookup;
   std::vector<Mat1f> allShifts;
   if (params.stage_dedistort) {
-    // Shifts will be computed during this run.
+    // Shifts will be computed during this run; when appending images, only
+    // for those that don't have them yet.
+    if (params.append && context.shifts.valid())
+      allShifts = context.shifts();
     allShifts.resize(context.images().size());
     refsqLookup = imageSumLookup(refimg.mul(refimg));
   }
@@ -318,130 +601,372 @@ Mat stack(const registrationParams& params,
   }
 
   // STACKING: initialization
-  Mat finalsum, normalization;
-  rbfWarper* rbf = nullptr;
+  std::vector<registrationParams::outputSpec> outputs;
+  std::vector<std::unique_ptr<tiledAccumulator>> finalsums;
+  // Which images are included in each output.
+  std::vector<std::vector<bool>> included;
+  std::map<int, std::unique_ptr<rbfWarper>> warpers;
   if (params.stage_stack) {
-    Mat sample = magickImread(context.images().at(0).filename);
-    finalsum = Mat::zeros(outputRectangle.size() * params.supersampling,
-                          CV_MAKETYPE(CV_32F, sample.channels()));
-    normalization = Mat::zeros(finalsum.size(), CV_32F);
-
-    // This could take quite some time if there is a lot of registration
-    // points. Inform the user about what is going on.
-    std::cerr << "Initializing the RBF warper (could take some time)... ";
-    rbf = new rbfWarper(context.patches(), context.imagesize(), outputRectangle,
-                 context.boxsize()/4, params.supersampling);
-    std::cerr << "done\n";
+    outputs = params.outputs();
+    for (const auto& output : outputs) {
+      const int channels = output.mono ? 1 : context.imagechannels();
+      finalsums.emplace_back(new tiledAccumulator(outputRectangle.size() * output.supersampling,
+                                                  channels));
+      const auto& images = context.images();
+      if (output.percent < 100)
+        included.push_back(sharpestImages(images,
+          std::max<size_t>(std::lround(images.size() * output.percent / 100), 1)));
+      else
+        included.push_back(std::vector<bool>(images.size(), true));
+
+      if (!warpers.count(output.supersampling)) {
+        // This could take quite some time if there is a lot of registration
+        // points. Inform the user about what is going on.
+        std::cerr << "Initializing the RBF warper (could take some time)... ";
+        warpers[output.supersampling].reset(
+          new rbfWarper(context.patches(), context.imagesize(), outputRectangle,
+                        context.boxsize()/4, output.supersampling));
+        std::cerr << "done\n";
+      }
+    }
   }
 
-  int progress = 0;
-  if (showProgress)
-    std::fprintf(stderr, "0/%ld", context.images().size());
-  #pragma omp parallel
-  {
-    // DEDISTORTION: local initialization
-    patchMatcher matcher;
-    // STACKING: local initialization
-    Mat localsum;
-    Mat localNormalization;
-    if (params.stage_stack) {
-      localsum = Mat::zeros(finalsum.size(), finalsum.type());
-      localNormalization = Mat::zeros(normalization.size(), CV_32F);
+  // CHECKPOINTS: pick up the results of an interrupted run
+  std::vector<bool> done(context.images().size(), false);
+  const std::string fingerprint = checkpointFingerprint(params, context);
+  if (params.resume && std::ifstream(params.checkpoint_file).good()) {
+    stackProgress saved = readCheckpoint(params.checkpoint_file);
+    bool matches = saved.fingerprint == fingerprint &&
+                   saved.done.size() == done.size() &&
+                   saved.sums.size() == finalsums.size();
+    for (size_t i = 0; matches && i < finalsums.size(); i++)
+      matches = saved.sums[i].size() == finalsums[i]->sum().size() &&
+                saved.sums[i].type() == finalsums[i]->sum().type() &&
+                saved.normalizations[i].size() == finalsums[i]->normalization().size();
+    // Shifts must exist for all processed images (if we are dedistorting)
+    // and fit the registration points.
+    const int patchCount = context.patches.valid() ? context.patches().size() : 0;
+    for (size_t i = 0; matches && i < saved.done.size(); i++) {
+      if (params.stage_dedistort && saved.done[i] && saved.shifts[i].empty())
+        matches = false;
+      if (!saved.shifts[i].empty() && saved.shifts[i].rows != patchCount)
+        matches = false;
     }
+    if (!matches)
+      throw std::runtime_error("checkpoint '" + params.checkpoint_file +
+                               "' was not created by an equivalent run");
+
+    done = saved.done;
+    for (size_t i = 0; i < finalsums.size(); i++) {
+      saved.sums[i].copyTo(finalsums[i]->sum());
+      saved.normalizations[i].copyTo(finalsums[i]->normalization());
+    }
+    if (params.stage_dedistort) {
+      for (size_t i = 0; i < done.size(); i++)
+        if (done[i])
+          allShifts.at(i) = saved.shifts[i];
+    }
+    std::cerr << "Resuming from '" << params.checkpoint_file << "': "
+              << std::count(done.begin(), done.end(), true) << " of "
+              << done.size() << " images already processed\n";
+  }
+  else if (params.resume)
+    std::cerr << "No checkpoint found at '" << params.checkpoint_file
+              << "', starting from the beginning\n";
+
+  // Images that were left without dedistortion shifts (by a run with a
+  // time budget, for example) can not be stacked unless dedistortion is
+  // performed now.
+  std::vector<int> pending;
+  for (size_t i = 0; i < done.size(); i++)
+    if (!done[i] &&
+        (params.stage_dedistort || allShifts.empty() || !allShifts[i].empty()))
+      pending.push_back(i);
+
+  // LIMITS: with a time budget or a limit on the number of images, the best
+  // images are processed first, so that whatever gets done is worth most.
+  const bool limited = params.time_budget > 0 || params.max_frames > 0;
+  if (limited && std::all_of(context.images().begin(), context.images().end(),
+                             [](const inputImage& image) { return image.quality >= 0; })) {
+    const auto& images = context.images();
+    std::stable_sort(pending.begin(), pending.end(), [&](int a, int b) {
+      return images[a].quality > images[b].quality;
+    });
+  }
+  const bool truncated = params.max_frames > 0 && pending.size() > params.max_frames;
+  if (truncated)
+    pending.resize(params.max_frames);
+
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::seconds(params.time_budget);
+  auto outOfTime = [&]() {
+    return params.time_budget > 0 && std::chrono::steady_clock::now() >= deadline;
+  };
+
+  std::unique_ptr<checkpointWriter> checkpoints;
+  if (!params.checkpoint_file.empty())
+    checkpoints.reset(new checkpointWriter(params.checkpoint_file,
+                                           params.checkpoint_interval));
+
+  struct stackJob {
+    int index;
+    // Set when the time budget ran out before the job was started.
+    bool skipped = false;
+    Mat image;
+    Mat gray;
+    Mat1f shifts;
+  };
+  framePipeline<stackJob> pipeline(params.readAhead());
+
+  // common step: load an image
+  pipeline.addStage(params.ioThreads(), [&](stackJob& job, int) {
+    if (outOfTime()) {
+      job.skipped = true;
+      return;
+    }
+    // Shifts from a state file, if any.
+    if (!allShifts.empty())
+      job.shifts = allShifts.at(job.index);
+    const bool needShifts = params.stage_dedistort && job.shifts.empty();
+    bool needImage = false;
+    for (const auto& members : included)
+      needImage |= members[job.index];
+    if (!(needShifts || needImage))
+      return;
+    job.image = readFrame(context.images().at(job.index),
+                          needShifts ? &job.gray : nullptr);
+    if (!needImage)
+      job.image.release();
+  });
+
+  // DEDISTORTION: main operation
+  std::vector<dedistortionWorkspace> workspaces(params.computeThreads());
+  std::unique_ptr<const patchPyramid> pyramid;
+  if (params.stage_dedistort && params.dedistort_pyramid > 0)
+    pyramid.reset(new patchPyramid(context, params.dedistort_pyramid));
+  if (params.stage_dedistort) {
+    pipeline.addStage(params.computeThreads(), [&](stackJob& job, int worker) {
+      if (job.skipped || !job.shifts.empty())
+        return;
+      job.shifts = dedistortionShifts(context, refsqLookup, context.images().at(job.index),
+                                      job.gray, workspaces.at(worker), pyramid.get());
+      job.gray.release();
+    });
+  }
 
-    // PARALLELIZED LOOP
-    #pragma omp for schedule(dynamic)
-    for (int ifile = 0; ifile < (signed)context.images().size(); ifile++) {
-      // common step: load an image
-      const auto& image = context.images().at(ifile);
-      Mat inputImage = magickImread(image.filename);
-
-      // DEDISTORTION: main operation
-      if (params.stage_dedistort) {
-        Mat1f img;
-        if (inputImage.channels() > 1)
-          cvtColor(inputImage, img, COLOR_BGR2GRAY);
-        else
-          img = inputImage;
-
-        // Image rectangle, expressed in coordinate systems of image itself
-        // and the reference image.
-        Rect img_coordImg(Point(0, 0), img.size());
-        Rect img_coordRefimg = img_coordImg - image.globalShift;
-
-        // Overlap between img and refimg, again according to both coordinate
-        // systems.
-        Rect overlap_coordRefimg = context.refimgRectangle() & img_coordRefimg;
-        Rect overlap_coordImg = overlap_coordRefimg + image.globalShift;
-
-        // Isolate the common portions of img and refimg.
-        Mat imgOverlap(img, overlap_coordImg);
-        Mat refimgOverlap(refimg, overlap_coordRefimg);
-
-        // Calculate optimal multiplier for img vs. refimg.
-        const float multiplier = sum(imgOverlap.mul(refimgOverlap))[0] /
-                                 refsqLookup.lookup(overlap_coordRefimg);
-
-        // Extract the part of image needed for matching and possibly pad it.
-        Rect totalArea = context.patches().searchAreaForImage(img_coordRefimg);
-        Rect searchOverlap = totalArea & img_coordRefimg;
-        Mat imgSearchRoi(img, searchOverlap + image.globalShift);
-        if (searchOverlap == totalArea)
-          img = imgSearchRoi;
-        else {
-          Mat paddedImg = Mat::zeros(totalArea.size(), img.type());
-          Rect destinationRoi = searchOverlap - totalArea.tl();
-          imgSearchRoi.copyTo(paddedImg(destinationRoi));
-          img = paddedImg;
-        }
-
-        // Find shifts for dedistortion.
-        allShifts.at(ifile) =
-          findShifts(img, totalArea, searchOverlap, context.patches(),
-                     multiplier, matcher);
-      }
-
-      // STACKING: main operation
-      if (params.stage_stack) {
-        const Mat1f shifts(params.stage_dedistort || context.shifts.valid() ?
-                           allShifts.at(ifile) : Mat());
+  // Per-image results (done, allShifts) are recorded as soon as an image
+  // has been completely processed, which for stacking means added to the
+  // final sums. The gate makes sure that checkpoints see sums that contain
+  // exactly the images marked as done.
+  std::mutex resultsLock;
+  snapshotGate gate;
+  auto recordResults = [&](const stackJob& job) {
+    std::lock_guard<std::mutex> lock(resultsLock);
+    if (params.stage_dedistort)
+      allShifts.at(job.index) = job.shifts;
+    done.at(job.index) = true;
+  };
+
+  // STACKING: main operation (the sums are shared by all workers, while
+  // each worker has its own warping buffers for each supersampling factor)
+  struct warpWorkspace {
+    rbfWarper::workspace warp;
+    Mat gray;
+  };
+  std::vector<std::map<int, warpWorkspace>> warpWorkspaces(params.computeThreads());
+  if (params.stage_stack) {
+    pipeline.addStage(params.computeThreads(), [&](stackJob& job, int worker) {
+      if (job.skipped)
+        return;
+      const Point2f globalShift = context.images().at(job.index).globalShift;
+      snapshotGate::updateScope update(gate);
+      for (const auto& warper : warpers) {
+        warpWorkspace& ws = warpWorkspaces.at(worker)[warper.first];
         Mat warpedImg, warpedNormalization;
-        std::tie(warpedImg, warpedNormalization) =
-          rbf->warp(inputImage, image.globalShift, shifts);
-        localsum += warpedImg;
-        localNormalization += warpedNormalization;
+        bool grayReady = false;
+        for (size_t i = 0; i < outputs.size(); i++) {
+          if (outputs[i].supersampling != warper.first || !included[i][job.index])
+            continue;
+          if (warpedImg.empty())
+            std::tie(warpedImg, warpedNormalization) =
+              warper.second->warp(job.image, globalShift, job.shifts, ws.warp);
+          if (outputs[i].mono && warpedImg.channels() > 1) {
+            if (!grayReady)
+              cvtColor(warpedImg, ws.gray, COLOR_BGR2GRAY);
+            grayReady = true;
+            finalsums[i]->add(ws.gray, warpedNormalization, 1);
+          }
+          else
+            finalsums[i]->add(warpedImg, warpedNormalization, 1);
+        }
       }
+      job.image.release();
+      recordResults(job);
+    });
+  }
 
-      // progress indication
-      if (showProgress) {
-        #pragma omp critical
-        std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, context.images().size());
-      }
-    } // end of loop
-
-    // STACKING: final sum
-    if (params.stage_stack) {
-      #pragma omp critical
-      {
-        finalsum += localsum;
-        normalization += localNormalization;
-      }
+  // progress indication and checkpoints
+  int progress = std::count(done.begin(), done.end(), true);
+  bool stopped = false;
+  pipeline.addStage(1, [&](stackJob& job, int) {
+    if (job.skipped) {
+      stopped = true;
+      pipeline.stop();
+      return;
+    }
+    if (!params.stage_stack)
+      recordResults(job);
+
+    // CHECKPOINTS: only the copying happens here, the writing is done in
+    // the background. The copy of the sum must contain exactly the images
+    // marked as done. Shifts are never modified in place, so sharing them
+    // is fine.
+    if (checkpoints && checkpoints->due()) {
+      stackProgress snapshot;
+      snapshot.fingerprint = fingerprint;
+      gate.freeze([&]() {
+        std::lock_guard<std::mutex> lock(resultsLock);
+        snapshot.done = done;
+        if (params.stage_dedistort)
+          snapshot.shifts = allShifts;
+        for (const auto& finalsum : finalsums) {
+          snapshot.sums.push_back(finalsum->sum().clone());
+          snapshot.normalizations.push_back(finalsum->normalization().clone());
+        }
+      });
+      checkpoints->submit(std::move(snapshot));
     }
-  } // end of parallel section
+
+    if (showProgress)
+      std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, context.images().size());
+  });
+
+  if (showProgress)
+    std::fprintf(stderr, "%d/%ld", progress, context.images().size());
+  pipeline.run(pending);
+  // Wait for any checkpoint that is still being written.
+  checkpoints.reset();
   if (showProgress)
     std::fprintf(stderr, "\n");
+  if (stopped || truncated) {
+    std::cerr << (stopped ? "Time budget exhausted; " : "Frame limit reached; ")
+              << progress << " of " << context.images().size()
+              << " images were processed\n";
+    // The periodic checkpoints lag behind; record everything that was done.
+    // The pipeline has finished, so nothing is modified any more.
+    if (!params.checkpoint_file.empty()) {
+      stackProgress snapshot;
+      snapshot.fingerprint = fingerprint;
+      snapshot.done = done;
+      if (params.stage_dedistort)
+        snapshot.shifts = allShifts;
+      for (const auto& finalsum : finalsums) {
+        snapshot.sums.push_back(finalsum->sum());
+        snapshot.normalizations.push_back(finalsum->normalization());
+      }
+      writeCheckpoint(params.checkpoint_file, snapshot);
+    }
+  }
+  if (stoppedEarly)
+    *stoppedEarly = stopped || truncated;
 
   // DEDISTORTION: pass the results to registrationContext
   if (params.stage_dedistort)
     context.shifts(allShifts);
 
-  if (params.stage_stack) {
-    divideChannelsByMask(finalsum, normalization);
-    delete rbf;
+  // This is only going to return something if we performed stacking;
+  // otherwise, the list of images will be empty.
+  std::vector<Mat> results;
+  for (const auto& finalsum : finalsums) {
+    divideChannelsByMask(finalsum->sum(), finalsum->normalization());
+    results.push_back(finalsum->sum());
   }
+  return results;
+}
+
 
-  // This is only going to return something meaningful if we performed
-  // stacking; otherwise, an empty image will be returned.
-  return finalsum;
+void tuneXcor(const registrationParams& params,
+              const registrationContext& context)
+{
+  xcorWisdom* wisdom = xcorWisdom::instance();
+  if (!wisdom || !context.patches.valid())
+    return;
+
+  auto tune = [wisdom](const patchCollection& patches) {
+    for (const auto& patch : patches)
+      wisdom->options(patch.image.size(), patch.searchArea.size(),
+                      patch.spectralDepth());
+  };
+  tune(context.patches());
+  if (params.dedistort_pyramid > 0) {
+    const patchPyramid pyramid(context, params.dedistort_pyramid);
+    tune(pyramid.coarse);
+    tune(pyramid.fine);
+  }
 }
 
+
+void comparePrecision(const registrationParams& params,
+                      const registrationContext& context)
+{
+  // Copies of the context whose registration points cook their templates
+  // with the given depth.
+  auto withDepth = [&](const int depth) {
+    patchCollection patches;
+    patches.patchCreationArea = context.patches().patchCreationArea;
+    for (const auto& patch : context.patches())
+      patches.push_back(imagePatch(context.refimg(), patch, context.boxsize(), depth));
+    registrationContext copy = context;
+    copy.patches(patches);
+    return copy;
+  };
+  const registrationContext doubleContext = withDepth(CV_64F);
+  const registrationContext singleContext = withDepth(CV_32F);
+
+  const Mat& refimg = context.refimg();
+  const imageSumLookup refsqLookup(refimg.mul(refimg));
+  dedistortionWorkspace workspace;
+  typedef std::chrono::steady_clock clock;
+  clock::duration doubleTime(0), singleTime(0);
+  double sumDifference = 0, maxDifference = 0;
+  long count = 0;
+
+  const size_t images = std::min<size_t>(params.compare_precision, context.images().size());
+  for (size_t i = 0; i < images; i++) {
+    const inputImage& image = context.images().at(i);
+    const Mat1f gray = readGrayFrame(image);
+
+    // The first round also cooks the templates, which is not timed.
+    if (i == 0) {
+      dedistortionShifts(doubleContext, refsqLookup, image, gray, workspace);
+      dedistortionShifts(singleContext, refsqLookup, image, gray, workspace);
+    }
+
+    auto start = clock::now();
+    const Mat1f doubleShifts =
+      dedistortionShifts(doubleContext, refsqLookup, image, gray, workspace);
+    doubleTime += clock::now() - start;
+    start = clock::now();
+    const Mat1f singleShifts =
+      dedistortionShifts(singleContext, refsqLookup, image, gray, workspace);
+    singleTime += clock::now() - start;
+
+    for (int p = 0; p < doubleShifts.rows; p++) {
+      const double difference = std::hypot(doubleShifts(p, 0) - singleShifts(p, 0),
+                                           doubleShifts(p, 1) - singleShifts(p, 1));
+      sumDifference += difference;
+      maxDifference = std::max(maxDifference, difference);
+      count++;
+    }
+  }
+
+  auto seconds = [](const clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+  std::fprintf(stderr, "Compared %ld shifts in %ld images\n", count, (long)images);
+  std::fprintf(stderr, "  difference between single and double precision (pixels):\n"
+                       "    mean %g, max %g\n",
+               count > 0 ? sumDifference / count : 0.0, maxDifference);
+  std::fprintf(stderr, "  matching time: double %.3f s, single %.3f s\n",
+               seconds(doubleTime), seconds(singleTime));
+}
@@ -23,9 +23,20 @@
 #include "registrationparams.h"
 #include "registrationcontext.h"
 #include "rbfwarper.h"
+#include "cookedtemplate.h"
 
+// Matches patches against images. It only holds working buffers, so each
+// thread needs its own instance; once the buffers have been allocated on
+// the first match, further matches (all patches have search areas of the
+// same size) do not allocate any memory.
 class patchMatcher {
 public:
+  // Prepares the summed-area table of the squared image; must be called
+  // for each image before matching patches against it.
+  void setImage(const cv::Mat1f& img);
+
+  // The returned matrix is one of the working buffers and is only valid
+  // until the next call.
   cv::Mat1f match(const cv::Mat1f& img,
                   const cv::Rect imgRect,
                   const cv::Rect validRect,
@@ -33,11 +44,46 @@ public:
                   const float multiplier);
 
 private:
+  xcorWorkspace xcor;
+  cv::Mat1f imgSquared;
+  cv::Mat1d imgSqIntegral;
+  cv::Mat1d boxSum;
   cv::Mat1f roisq;
   cv::Mat1f cor;
   cv::Mat1f patchsq;
   cv::Mat1f normalization;
   cv::Mat1f imgValidMask;
+  cv::Mat1f validCols;
+  cv::Mat1f validRows;
+  cv::Mat1f result;
+};
+
+
+// Working buffers of a single thread doing dedistortion in stack().
+struct dedistortionWorkspace {
+  patchMatcher matcher;
+  cv::Mat translatedImg;
+  cv::Mat paddedImg;
+  // coarse-to-fine matching
+  patchMatcher coarseMatcher;
+  std::vector<cv::Mat> pyramidImgs;  // one per level, the last is the coarsest
+};
+
+
+// Registration points for coarse-to-fine matching. The shift of each point
+// is first estimated over the whole search area on images that are
+// downsampled levels times by a factor of two (coarse, whose patches
+// correspond to those of the context), and then refined at full
+// resolution within a small window around the estimate (fine, whose search
+// areas only give the size of the window).
+class patchPyramid {
+public:
+  patchPyramid(const registrationContext& context, int levels);
+
+  int levels;
+  int factor;
+  patchCollection coarse;
+  patchCollection fine;
 };
 
 
@@ -66,6 +112,13 @@ private:
 };
 
 
+// Refines the location of the minimum of a match surface, found at an
+// interior point coarseMin, to subpixel precision. Returns the correction
+// to coarseMin (within half a pixel); zero if no reliable correction can
+// be found.
+cv::Point2f subpixelCorrection(const cv::Mat& match, const cv::Point coarseMin);
+
+
 patchCollection selectPointsHex(const registrationParams& params,
                                 const registrationContext& context,
                                 const cv::Rect patchCreationArea);
@@ -75,8 +128,25 @@ patchCollection filterPatchesByQuality(const patchCollection& patches,
 
 cv::Mat drawPoints(const cv::Mat& img, const patchCollection& patches);
 
-cv::Mat stack(const registrationParams& params,
-              registrationContext& context,
-              const bool showProgress = false);
+// Times the cross-correlation of every patch geometry that dedistortion
+// matches, including those of the patchPyramid, if the global xcorWisdom is
+// enabled. Afterwards the matching threads only look the options up.
+void tuneXcor(const registrationParams& params,
+              const registrationContext& context);
+
+// Dedistorts the first params.compare_precision images with single and with
+// double precision spectra (see cookedXcor) and reports how much the shifts
+// differ and how long the matching took.
+void comparePrecision(const registrationParams& params,
+                      const registrationContext& context);
+
+// Returns one stacked image for each of params.outputs() if stacking was
+// requested. If the time budget or the frame limit left some images
+// unprocessed, *stoppedEarly is set and the checkpoint (if any) holds the
+// progress.
+std::vector<cv::Mat> stack(const registrationParams& params,
+                           registrationContext& context,
+                           const bool showProgress = false,
+                           bool* stoppedEarly = nullptr);
 
 #endif // DEDISTORT_H
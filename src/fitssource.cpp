@@ -0,0 +1,273 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "fitssource.h"
+#include "imageops.h"
+
+using namespace cv;
+
+namespace {
+  const size_t blockSize = 2880;
+  const size_t cardSize = 80;
+
+  template <typename T>
+  T readBigEndian(const unsigned char* p);
+
+  template <>
+  uint8_t readBigEndian<uint8_t>(const unsigned char* p) {
+    return p[0];
+  }
+
+  template <>
+  int16_t readBigEndian<int16_t>(const unsigned char* p) {
+    return (int16_t)((p[0] << 8) | p[1]);
+  }
+
+  template <>
+  int32_t readBigEndian<int32_t>(const unsigned char* p) {
+    return (int32_t)(((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+  }
+
+  template <>
+  float readBigEndian<float>(const unsigned char* p) {
+    uint32_t bits = readBigEndian<int32_t>(p);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+  // Converts one plane of the data array, flipping it vertically.
+  template <typename T>
+  void convertPlane(const unsigned char* data, Mat& output, double scale, double offset) {
+    for (int row = 0; row < output.rows; row++) {
+      const unsigned char* src = data + (size_t)(output.rows - 1 - row)*output.cols*sizeof(T);
+      float* dst = output.ptr<float>(row);
+      for (int x = 0; x < output.cols; x++, src += sizeof(T))
+        dst[x] = readBigEndian<T>(src)*scale + offset;
+    }
+  }
+
+  std::string cardKeyword(const char* card) {
+    std::string keyword(card, 8);
+    return keyword.substr(0, keyword.find_last_not_of(' ') + 1);
+  }
+
+  std::string cardValue(const char* card) {
+    if (std::strncmp(card + 8, "= ", 2) != 0)
+      return "";
+    std::string value(card + 10, cardSize - 10);
+    value = value.substr(0, value.find('/'));
+    size_t first = value.find_first_not_of(' ');
+    if (first == std::string::npos)
+      return "";
+    return value.substr(first, value.find_last_not_of(' ') - first + 1);
+  }
+
+  // The value of a string card, without the quotes and trailing blanks.
+  std::string stringValue(const std::string& value) {
+    if (value.size() < 2 || value.front() != '\'' || value.back() != '\'')
+      return value;
+    std::string s = value.substr(1, value.size() - 2);
+    return s.substr(0, s.find_last_not_of(' ') + 1);
+  }
+
+  std::string card(const std::string& keyword, const std::string& value) {
+    char buf[cardSize + 1];
+    std::snprintf(buf, sizeof(buf), "%-8s= %20s", keyword.c_str(), value.c_str());
+    std::string c(buf);
+    c.resize(cardSize, ' ');
+    return c;
+  }
+
+  std::string stringCard(const std::string& keyword, const std::string& value) {
+    char buf[cardSize + 1];
+    std::snprintf(buf, sizeof(buf), "%-8s= '%-8s'", keyword.c_str(), value.c_str());
+    std::string c(buf);
+    c.resize(cardSize, ' ');
+    return c;
+  }
+}
+
+
+bool isFitsFile(const std::string& filename) {
+  return hasExtension(filename, ".fits") ||
+         hasExtension(filename, ".fit") ||
+         hasExtension(filename, ".fts");
+}
+
+
+fitsSource::fitsSource(const std::string& filename) : file(filename) {
+  const char* header = reinterpret_cast<const char*>(file.data());
+  if (file.size() < blockSize || cardKeyword(header) != "SIMPLE")
+    throw std::runtime_error("'" + filename + "' is not a FITS file");
+
+  int naxis = -1;
+  int naxes[3] = {1, 1, 1};
+  std::string ctype3;
+  bitpix = 0;
+  size_t pos = 0;
+  for (;; pos += cardSize) {
+    if (pos + cardSize > file.size())
+      throw std::runtime_error("'" + filename + "': FITS header without END");
+    const char* c = header + pos;
+    std::string keyword = cardKeyword(c);
+    if (keyword == "END")
+      break;
+    else if (keyword == "BITPIX")
+      bitpix = std::stoi(cardValue(c));
+    else if (keyword == "NAXIS")
+      naxis = std::stoi(cardValue(c));
+    else if (keyword == "NAXIS1" || keyword == "NAXIS2" || keyword == "NAXIS3")
+      naxes[keyword[5] - '1'] = std::stoi(cardValue(c));
+    else if (keyword == "BZERO")
+      bzero = std::stod(cardValue(c));
+    else if (keyword == "BSCALE")
+      bscale = std::stod(cardValue(c));
+    else if (keyword == "CTYPE3")
+      ctype3 = stringValue(cardValue(c));
+  }
+  dataOffset = (pos / blockSize + 1) * blockSize;
+
+  if (bitpix != 8 && bitpix != 16 && bitpix != 32 && bitpix != -32)
+    throw std::runtime_error("'" + filename + "': unsupported BITPIX " + std::to_string(bitpix));
+  if (naxis < 2 || naxis > 3)
+    throw std::runtime_error("'" + filename + "': only 2D images and 3D cubes are supported");
+
+  width = naxes[0];
+  height = naxes[1];
+  frames = naxis == 3 ? naxes[2] : 1;
+  // A cube of three planes marked as RGB (as written by writeFits32F()) is
+  // a single colour image.
+  if (naxis == 3 && naxes[2] == 3 && ctype3 == "RGB") {
+    frames = 1;
+    channels = 3;
+  }
+  const size_t frameBytes = (size_t)width * height * channels * std::abs(bitpix)/8;
+  if (width <= 0 || height <= 0 || frames <= 0 ||
+      file.size() < dataOffset + frames*frameBytes)
+    throw std::runtime_error("'" + filename + "': corrupt or truncated FITS file");
+}
+
+
+Mat fitsSource::read(int frame) const {
+  if (frame < 0 || frame >= frames)
+    throw std::out_of_range("FITS frame index " + std::to_string(frame) + " out of range");
+
+  const size_t planeBytes = (size_t)width * height * std::abs(bitpix)/8;
+  const unsigned char* data = file.data() + dataOffset + frame*planeBytes*channels;
+
+  // Signed integers in FITS are shifted by BZERO to represent unsigned
+  // values; normalize those to [0, 1]. Data without that shift are
+  // genuinely signed and are offset into the unsigned range first.
+  std::vector<Mat> planes;
+  for (int c = 0; c < channels; c++, data += planeBytes) {
+    Mat plane(height, width, CV_32F);
+    switch (bitpix) {
+      case 8:
+        convertPlane<uint8_t>(data, plane, bscale/255, bzero/255);
+        break;
+      case 16: {
+        const double offset = bzero != 0 ? bzero : 32768*bscale;
+        convertPlane<int16_t>(data, plane, bscale/65535, offset/65535);
+        break;
+      }
+      case 32: {
+        const double offset = bzero != 0 ? bzero : 2147483648.0*bscale;
+        convertPlane<int32_t>(data, plane, bscale/4294967295.0, offset/4294967295.0);
+        break;
+      }
+      case -32:
+        convertPlane<float>(data, plane, bscale, bzero);
+        break;
+    }
+    planes.push_back(plane);
+  }
+  if (channels == 1)
+    return planes[0];
+
+  // The planes are red, green and blue; OpenCV wants BGR.
+  std::reverse(planes.begin(), planes.end());
+  Mat output;
+  merge(planes, output);
+  return output;
+}
+
+
+frameInfo fitsSource::probe(int) const {
+  frameInfo info;
+  info.size = Size(width, height);
+  info.channels = channels;
+  info.bitDepth = std::abs(bitpix);
+  return info;
+}
+
+
+void writeFits32F(const std::string& filename, const Mat& image) {
+  CV_Assert(image.depth() == CV_32F);
+  CV_Assert(image.channels() == 1 || image.channels() == 3);
+
+  std::string header;
+  header += card("SIMPLE", "T");
+  header += card("BITPIX", "-32");
+  header += card("NAXIS", image.channels() > 1 ? "3" : "2");
+  header += card("NAXIS1", std::to_string(image.cols));
+  header += card("NAXIS2", std::to_string(image.rows));
+  if (image.channels() > 1) {
+    header += card("NAXIS3", std::to_string(image.channels()));
+    header += stringCard("CTYPE3", "RGB");
+  }
+  header += std::string("END").append(cardSize - 3, ' ');
+  header.resize((header.size() + blockSize - 1) / blockSize * blockSize, ' ');
+
+  std::vector<Mat> planes;
+  split(image, planes);
+  // OpenCV stores colour as BGR; FITS cubes are conventionally RGB.
+  std::reverse(planes.begin(), planes.end());
+
+  std::ofstream out(filename, std::ios::binary);
+  out.write(header.data(), header.size());
+  std::vector<unsigned char> row(image.cols * 4);
+  for (const auto& plane : planes) {
+    for (int y = plane.rows - 1; y >= 0; y--) {
+      const float* src = plane.ptr<float>(y);
+      for (int x = 0; x < plane.cols; x++) {
+        uint32_t bits;
+        std::memcpy(&bits, src + x, sizeof(bits));
+        row[4*x] = bits >> 24;
+        row[4*x + 1] = bits >> 16;
+        row[4*x + 2] = bits >> 8;
+        row[4*x + 3] = bits;
+      }
+      out.write(reinterpret_cast<const char*>(row.data()), row.size());
+    }
+  }
+  const size_t dataSize = image.total() * image.channels() * 4;
+  const size_t padding = (blockSize - dataSize % blockSize) % blockSize;
+  out.write(std::string(padding, '\0').data(), padding);
+  out.close();
+  if (!out)
+    throw std::runtime_error("error writing '" + filename + "'");
+}
@@ -0,0 +1,65 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FITSSOURCE_H
+#define FITSSOURCE_H
+
+#include <string>
+#include "framesource.h"
+#include "mappedfile.h"
+
+// Reader for FITS files with BITPIX 8, 16, 32 or -32. A three-dimensional
+// data cube (NAXIS3 > 1) is treated as a sequence of frames, except for a
+// cube of three planes with CTYPE3 = 'RGB', which is a colour image. The
+// file is memory mapped and samples are converted straight from the mapping.
+//
+// Integer data are scaled so that the full unsigned range of the physical
+// values (after BZERO and BSCALE) maps to [0, 1]; signed data without a
+// BZERO are offset by half of the range first. Float data are taken as
+// they are. In any case, FITS data are taken to be linear. Rows are flipped
+// so that the first row of the data array ends up at the bottom of the
+// image, as is the convention for FITS.
+class fitsSource : public frameSource {
+public:
+  fitsSource(const std::string& filename);
+
+  int frameCount() const { return frames; }
+  bool container() const { return frames > 1; }
+  cv::Mat read(int frame) const;
+  frameInfo probe(int frame) const;
+
+private:
+  mappedFile file;
+  int bitpix;
+  int width;
+  int height;
+  int frames;
+  int channels = 1;
+  double bzero = 0;
+  double bscale = 1;
+  size_t dataOffset;
+};
+
+bool isFitsFile(const std::string& filename);
+
+// Writes a CV_32F or CV_32FC3 image into a FITS file with BITPIX -32. Colour
+// images are written as a cube of three planes (red, green, blue), marked
+// with CTYPE3 = 'RGB' so that fitsSource reads them back as colour.
+void writeFits32F(const std::string& filename, const cv::Mat& image);
+
+#endif // FITSSOURCE_H
@@ -0,0 +1,222 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "framecache.h"
+#include "mappedfile.h"
+
+using namespace cv;
+namespace bf = boost::filesystem;
+
+// Cache file layout (native byte order):
+//   magic       8 bytes
+//   header      cacheHeader
+//   key         keyLength bytes
+//   padding     up to the next multiple of dataAlignment
+//   colour      rows*cols*channels elements
+//   gray        rows*cols elements (omitted for single-channel frames)
+namespace {
+  const char magic[8] = {'L', 'Y', 'K', 'F', 'R', 'M', 'C', '1'};
+  const size_t dataAlignment = 64;
+
+  struct cacheHeader {
+    uint32_t keyLength;
+    uint32_t storage;
+    int32_t rows;
+    int32_t cols;
+    int32_t channels;
+    uint32_t reserved;
+  };
+
+  size_t dataOffset(size_t keyLength) {
+    size_t offset = sizeof(magic) + sizeof(cacheHeader) + keyLength;
+    return (offset + dataAlignment - 1) / dataAlignment * dataAlignment;
+  }
+
+  int storageDepth(frameCache::storageType storage) {
+    switch (storage) {
+      case frameCache::storageType::Half: return CV_16F;
+      case frameCache::storageType::UInt16: return CV_16U;
+      default: return CV_32F;
+    }
+  }
+
+  double storageScale(frameCache::storageType storage) {
+    return storage == frameCache::storageType::UInt16 ? 65535.0 : 1.0;
+  }
+
+  // 64-bit FNV-1a; used only to derive file names, so collisions are
+  // harmless (the full key is verified on every read).
+  uint64_t fnv1a(const std::string& str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : str) {
+      hash ^= c;
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+}
+
+
+std::unique_ptr<frameCache> frameCache::globalCache;
+
+
+frameCache::frameCache(const std::string& directory_, storageType storage_) :
+  directory(directory_), storage(storage_)
+{
+  bf::create_directories(directory);
+}
+
+
+void frameCache::enable(const std::string& directory, storageType storage) {
+  globalCache.reset(new frameCache(directory, storage));
+}
+
+
+std::string frameCache::key(const inputImage& image) const {
+  bf::path file = bf::absolute(image.filename);
+  return file.string() + "\n" +
+         std::to_string(image.frame) + "\n" +
+         std::to_string(bf::file_size(file)) + "\n" +
+         std::to_string(bf::last_write_time(file));
+}
+
+
+std::string frameCache::path(const std::string& key) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.lfc", (unsigned long long)fnv1a(key));
+  return (bf::path(directory) / name).string();
+}
+
+
+bool frameCache::fetch(const inputImage& image, Mat* color, Mat* gray) const {
+  const std::string k = key(image);
+  const std::string p = path(k);
+  if (!bf::exists(p))
+    return false;
+
+  mappedFile file(p);
+  const unsigned char* ptr = file.data();
+  if (file.size() < sizeof(magic) + sizeof(cacheHeader) ||
+      std::memcmp(ptr, magic, sizeof(magic)) != 0)
+    return false;
+
+  cacheHeader header;
+  std::memcpy(&header, ptr + sizeof(magic), sizeof(header));
+  const char* storedKey = reinterpret_cast<const char*>(ptr + sizeof(magic) + sizeof(header));
+  if (header.keyLength != k.length() ||
+      file.size() < sizeof(magic) + sizeof(header) + k.length() ||
+      std::memcmp(storedKey, k.data(), k.length()) != 0)
+    return false;
+
+  // Reject headers that can't have been written by store().
+  if (header.storage > static_cast<uint32_t>(storageType::UInt16) ||
+      header.rows <= 0 || header.cols <= 0 ||
+      header.channels < 1 || header.channels > 4)
+    return false;
+
+  const storageType stored = static_cast<storageType>(header.storage);
+  const int depth = storageDepth(stored);
+  const size_t planeSize = (size_t)header.rows * header.cols * CV_ELEM_SIZE1(depth);
+  const size_t offset = dataOffset(header.keyLength);
+  const bool hasGrayPlane = header.channels > 1;
+  if (file.size() < offset + planeSize*(header.channels + hasGrayPlane))
+    return false;
+
+  // The mapping goes away when we return, so the data is copied out of it,
+  // but this happens as a part of the conversion to float that is needed
+  // anyway.
+  const double scale = 1/storageScale(stored);
+  Mat colorPlanes(header.rows, header.cols, CV_MAKETYPE(depth, header.channels),
+                  file.data() + offset);
+  if (color)
+    colorPlanes.convertTo(*color, CV_MAKETYPE(CV_32F, header.channels), scale);
+  if (gray) {
+    if (hasGrayPlane) {
+      Mat grayPlane(header.rows, header.cols, depth,
+                    file.data() + offset + planeSize*header.channels);
+      grayPlane.convertTo(*gray, CV_32F, scale);
+    }
+    else if (color)
+      *gray = *color;
+    else
+      colorPlanes.convertTo(*gray, CV_32F, scale);
+  }
+  return true;
+}
+
+
+void frameCache::store(const inputImage& image, const Mat& color, const Mat& gray) const {
+  std::string tmp;
+  try {
+    const std::string k = key(image);
+    const std::string p = path(k);
+    const int depth = storageDepth(storage);
+    const double scale = storageScale(storage);
+
+    cacheHeader header;
+    header.keyLength = k.length();
+    header.storage = static_cast<uint32_t>(storage);
+    header.rows = color.rows;
+    header.cols = color.cols;
+    header.channels = color.channels();
+    header.reserved = 0;
+
+    // Write into a temporary file that is renamed when complete; this way,
+    // concurrent readers (and other instances of lycklig) never see a
+    // partially written entry.
+    tmp = (bf::path(directory) / bf::unique_path("%%%%%%%%.tmp")).string();
+    std::ofstream out(tmp, std::ios::binary);
+    out.write(magic, sizeof(magic));
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(k.data(), k.length());
+    const size_t padding = dataOffset(k.length()) - sizeof(magic) - sizeof(header) - k.length();
+    out.write(std::string(padding, '\0').data(), padding);
+
+    Mat converted;
+    color.convertTo(converted, CV_MAKETYPE(depth, color.channels()), scale);
+    out.write(reinterpret_cast<const char*>(converted.data),
+              converted.total()*converted.elemSize());
+    if (color.channels() > 1) {
+      gray.convertTo(converted, depth, scale);
+      out.write(reinterpret_cast<const char*>(converted.data),
+                converted.total()*converted.elemSize());
+    }
+    out.close();
+    if (!out)
+      throw std::runtime_error("write error");
+    bf::rename(tmp, p);
+  }
+  catch (std::exception& e) {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
+    std::cerr << "WARNING: could not cache '" << image.name() << "': "
+              << e.what() << "\n";
+    if (!tmp.empty()) {
+      boost::system::error_code ignored;
+      bf::remove(tmp, ignored);
+    }
+  }
+}
@@ -0,0 +1,61 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <string>
+#include <memory>
+#include <opencv2/core/core.hpp>
+#include "registrationparams.h"
+#include "registrationcontext.h"
+
+// An on-disk cache of decoded frames. Each frame is stored once, already
+// converted to linear RGB, together with its gray version, in a file that
+// can be memory mapped on subsequent reads. Entries are keyed by the file
+// name, frame index, modification time and size of the original file, so
+// stale entries are never used.
+class frameCache {
+public:
+  typedef registrationParams::cacheStorage storageType;
+
+  frameCache(const std::string& directory, storageType storage);
+
+  // Fetches the colour frame and/or the gray frame (either pointer may be
+  // null). Returns false if the frame is not in the cache. Thread safe.
+  bool fetch(const inputImage& image, cv::Mat* color, cv::Mat* gray) const;
+  // Thread safe. Failures are reported but otherwise ignored: the cache is
+  // merely an optimization.
+  void store(const inputImage& image, const cv::Mat& color, const cv::Mat& gray) const;
+
+  // Global cache used by readFrame(). Should be enabled before any frames
+  // are read.
+  static void enable(const std::string& directory, storageType storage);
+  static const frameCache* instance() { return globalCache.get(); }
+
+private:
+  std::string key(const inputImage& image) const;
+  std::string path(const std::string& key) const;
+
+  const std::string directory;
+  const storageType storage;
+
+  static std::unique_ptr<frameCache> globalCache;
+};
+
+#endif // FRAMECACHE_H
@@ -0,0 +1,132 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <Magick++.h>
+#include "framesource.h"
+#include "sersource.h"
+#include "fitssource.h"
+#include "framecache.h"
+#include "imageops.h"
+
+using namespace cv;
+
+std::shared_ptr<const frameSource> frameSource::open(const std::string& filename) {
+  const bool ser = hasExtension(filename, ".ser");
+  if (!ser && !isFitsFile(filename))
+    return std::make_shared<magickSource>(filename);
+
+  // Containers are kept open for the lifetime of the program so that their
+  // headers are parsed (and the files mapped) only once.
+  static std::mutex mutex;
+  static std::map<std::string, std::shared_ptr<const frameSource>> containers;
+  std::lock_guard<std::mutex> lock(mutex);
+
+  auto found = containers.find(filename);
+  if (found != containers.end())
+    return found->second;
+
+  std::shared_ptr<const frameSource> source;
+  if (ser)
+    source = std::make_shared<serSource>(filename);
+  else
+    source = std::make_shared<fitsSource>(filename);
+  // FITS files are containers only if they hold a data cube.
+  if (source->container())
+    containers[filename] = source;
+  return source;
+}
+
+
+Mat magickSource::read(int) const {
+  return magickImread(filename);
+}
+
+
+frameInfo magickSource::probe(int) const {
+  Magick::Image image;
+  image.ping(filename);
+  frameInfo info;
+  info.size = Size(image.columns(), image.rows());
+  // Same rule as in magickImread().
+  info.channels = image.colorSpace() == Magick::GRAYColorspace ? 1 : 3;
+  info.bitDepth = image.depth();
+  return info;
+}
+
+
+std::vector<inputImage> expandInputFiles(const std::vector<std::string>& files) {
+  std::vector<inputImage> images;
+  for (auto& file : files) {
+    auto source = frameSource::open(file);
+    if (source->container()) {
+      for (int frame = 0; frame < source->frameCount(); frame++)
+        images.push_back(inputImage(file, frame));
+    }
+    else
+      images.push_back(inputImage(file));
+  }
+  return images;
+}
+
+
+static Mat toGray(const Mat& img) {
+  if (img.channels() == 1)
+    return img;
+  Mat gray;
+  cvtColor(img, gray, COLOR_BGR2GRAY);
+  return gray;
+}
+
+
+Mat readFrame(const inputImage& image, Mat* gray) {
+  const frameCache* cache = frameCache::instance();
+  Mat color;
+  if (cache && cache->fetch(image, &color, gray))
+    return color;
+
+  // An image that refers to a container as a whole stands for its first
+  // frame (this happens, e.g., with --prereg-img).
+  color = frameSource::open(image.filename)->read(std::max(image.frame, 0));
+  if (cache || gray) {
+    Mat grayColor = toGray(color);
+    if (cache)
+      cache->store(image, color, grayColor);
+    if (gray)
+      *gray = grayColor;
+  }
+  return color;
+}
+
+
+frameInfo probeFrame(const inputImage& image) {
+  return frameSource::open(image.filename)->probe(std::max(image.frame, 0));
+}
+
+
+Mat readGrayFrame(const inputImage& image) {
+  const frameCache* cache = frameCache::instance();
+  Mat gray;
+  if (cache && cache->fetch(image, nullptr, &gray))
+    return gray;
+  readFrame(image, &gray);
+  return gray;
+}
@@ -0,0 +1,90 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <opencv2/core/core.hpp>
+#include "registrationcontext.h"
+
+// Basic properties of a frame that can be determined without decoding it.
+struct frameInfo {
+  cv::Size size;
+  int channels;
+  // Bits per sample in the file.
+  int bitDepth;
+};
+
+
+// A frameSource provides decoded frames from a single input file. Plain image
+// files contain exactly one frame and are decoded via ImageMagick; video
+// containers (SER videos, FITS cubes) hold many frames and are read by
+// dedicated readers.
+//
+// All frames are returned in linear RGB (BGR channel order) or gray, as
+// CV_32FC3 or CV_32F matrices.
+class frameSource {
+public:
+  virtual ~frameSource() = default;
+
+  virtual int frameCount() const = 0;
+  // Whether the file holds a sequence of frames that are addressed by index
+  // (as opposed to a plain image file).
+  virtual bool container() const = 0;
+  // Thread safe.
+  virtual cv::Mat read(int frame) const = 0;
+  // Reads only as much of the file as needed to determine the properties of
+  // the frame. Thread safe.
+  virtual frameInfo probe(int frame) const = 0;
+
+  // Returns the frame source for the given file. Containers are opened only
+  // once and shared among all callers. Thread safe.
+  static std::shared_ptr<const frameSource> open(const std::string& filename);
+};
+
+
+class magickSource : public frameSource {
+public:
+  magickSource(const std::string& filename_) : filename(filename_) {}
+
+  int frameCount() const { return 1; }
+  bool container() const { return false; }
+  cv::Mat read(int frame) const;
+  frameInfo probe(int frame) const;
+
+private:
+  const std::string filename;
+};
+
+
+// Converts the list of files given on the command line into the list of
+// input images. Every frame of a container becomes a separate input image.
+std::vector<inputImage> expandInputFiles(const std::vector<std::string>& files);
+
+// Reads a frame (using the frame cache, if enabled) and, if gray is not
+// null, also its gray version.
+cv::Mat readFrame(const inputImage& image, cv::Mat* gray = nullptr);
+
+cv::Mat readGrayFrame(const inputImage& image);
+
+frameInfo probeFrame(const inputImage& image);
+
+#endif // FRAMESOURCE_H
@@ -17,62 +17,281 @@
  */
 
 #include "globalregistrator.h"
+#include "framesource.h"
+#include "pipeline.h"
+#include "dedistort.h"
 
 using namespace cv;
 
-globalRegistrator::globalRegistrator(const Mat& reference, const int maxmove) {
+globalReference::globalReference(const Mat& reference, const int maxmove_,
+                                 const int pyramidLevels_,
+                                 const engineType engine) :
+  maxmove(maxmove_), pyramidLevels(pyramidLevels_)
+{
   refImgWithBorder = Mat::zeros(reference.rows + 2*maxmove, reference.cols + 2*maxmove, CV_32F);
   Rect imageRect = Rect(maxmove, maxmove, reference.cols, reference.rows);
   reference.copyTo(refImgWithBorder(imageRect));
   refImageArea = Mat::zeros(reference.rows + 2*maxmove, reference.cols + 2*maxmove, CV_32F);
   refImageArea(imageRect) = Mat::ones(reference.rows, reference.cols, CV_32F);
-  searchMask = Mat::ones(reference.rows, reference.cols, CV_32F);
-  matchTemplate(refImgWithBorder.mul(refImgWithBorder), searchMask, areasq, TM_CCORR);
   originShift = Point(maxmove, maxmove);
+
+  if (pyramidLevels > 0) {
+    // The full search is done on the coarse level; areasq is never needed
+    // at full resolution.
+    Mat smallRef = reference;
+    for (int i = 0; i < pyramidLevels; i++)
+      pyrDown(smallRef, smallRef);
+    const int factor = 1 << pyramidLevels;
+    coarse.reset(new globalReference(smallRef, (maxmove + factor - 1) / factor,
+                                     0, engine));
+  }
+  else {
+    Mat1f searchMask = Mat::ones(reference.rows, reference.cols, CV_32F);
+    matchTemplate(refImgWithBorder.mul(refImgWithBorder), searchMask, areasq, TM_CCORR);
+    if (engine == engineType::Spectral) {
+      refSpectrum.reset(new cookedReference(refImgWithBorder, reference.size()));
+      areaSpectrum.reset(new cookedReference(refImageArea, reference.size()));
+    }
+  }
 }
 
 
+globalRegistrator::globalRegistrator(std::shared_ptr<const globalReference> reference) :
+  ref(reference) {}
+
+
 void globalRegistrator::findShift(inputImage& image, const Mat& pixels)
 {
-  matchTemplate(refImageArea, pixels.mul(pixels), imgsq, TM_CCORR);
-  matchTemplate(refImgWithBorder, pixels, cor, TM_CCORR);
-  match = areasq - cor.mul(cor).mul(1/imgsq);
+  Point2f minpoint;
+  float multiplier;
+  if (ref->coarse) {
+    const globalReference& coarse = *ref->coarse;
+    Mat smallPixels = pixels;
+    for (int i = 0; i < ref->pyramidLevels; i++)
+      pyrDown(smallPixels, smallPixels);
+    float coarseMultiplier;
+    Point2f coarseMin = fullSearch(coarse, smallPixels, coarseMultiplier);
+    // The estimate is accurate to about one pixel on the coarse level.
+    const int factor = 1 << ref->pyramidLevels;
+    Point2f offset = (coarseMin - Point2f(coarse.originShift)) * factor;
+    Point estimate = ref->originShift + Point(cvRound(offset.x), cvRound(offset.y));
+    minpoint = localSearch(*ref, pixels, estimate, 2*factor, multiplier);
+  }
+  else
+    minpoint = fullSearch(*ref, pixels, multiplier);
+
+  image.globalShift = -(minpoint - Point2f(ref->originShift));
+  image.globalMultiplier = multiplier;
+}
+
+
+Point2f globalRegistrator::fullSearch(const globalReference& level,
+                                      const Mat& pixels, float& multiplier)
+{
+  if (level.refSpectrum) {
+    level.areaSpectrum->match(pixels.mul(pixels), imgsq, workspace);
+    level.refSpectrum->match(pixels, cor, workspace);
+  }
+  else {
+    matchTemplate(level.refImageArea, pixels.mul(pixels), imgsq, TM_CCORR);
+    matchTemplate(level.refImgWithBorder, pixels, cor, TM_CCORR);
+  }
+  match = level.areasq - cor.mul(cor).mul(1/imgsq);
+  return matchMinimum(level.areasq, multiplier);
+}
+
+
+Point2f globalRegistrator::localSearch(const globalReference& level,
+                                       const Mat& pixels, const Point center,
+                                       const int radius, float& multiplier)
+{
+  // Window of candidate positions, trimmed to the valid range.
+  const int maxmove = level.maxmove;
+  const Point lo(std::max(center.x - radius, 0), std::max(center.y - radius, 0));
+  const Point hi(std::min(center.x + radius, 2*maxmove),
+                 std::min(center.y + radius, 2*maxmove));
+  const Rect region(lo, pixels.size() + Size(hi.x - lo.x, hi.y - lo.y));
+
+  matchTemplate(level.refImageArea(region), pixels.mul(pixels), imgsq, TM_CCORR);
+  matchTemplate(level.refImgWithBorder(region), pixels, cor, TM_CCORR);
+
+  // areasq for the window only, from the integral of the squared region.
+  Mat1f regionImg(level.refImgWithBorder(region));
+  integral(regionImg.mul(regionImg), windowsq, CV_64F);
+  windowAreasq.create(cor.size());
+  const int w = pixels.cols, h = pixels.rows;
+  for (int y = 0; y < windowAreasq.rows; y++)
+    for (int x = 0; x < windowAreasq.cols; x++)
+      windowAreasq(y, x) = windowsq(y + h, x + w) - windowsq(y, x + w)
+                           - windowsq(y + h, x) + windowsq(y, x);
+
+  match = windowAreasq - cor.mul(cor).mul(1/imgsq);
+  return Point2f(lo) + matchMinimum(windowAreasq, multiplier);
+}
+
+
+Point2f globalRegistrator::matchMinimum(const Mat1f& areasq, float& multiplier) const
+{
   Point minpoint;
   minMaxLoc(match, NULL, NULL, &minpoint);
-  image.globalShift = -(minpoint - originShift);
-  image.globalMultiplier = cor(minpoint) / areasq(minpoint);
+  multiplier = cor(minpoint) / areasq(minpoint);
+
+  // Subpixel refinement is only possible away from the edges.
+  Point2f subpixel(minpoint);
+  if (minpoint.x > 0 && minpoint.y > 0 &&
+      minpoint.x < match.cols - 1 && minpoint.y < match.rows - 1)
+    subpixel += subpixelCorrection(match, minpoint);
+  return subpixel;
+}
+
+
+// The area of the reference image that is covered by all images. With
+// subpixel shifts, only whole pixels that are completely covered by an image
+// are considered to be common.
+static Rect commonRectangle(const std::vector<inputImage>& images, const Size size)
+{
+  Rect crop(Point(0, 0), size);
+  for (auto& image : images) {
+    const Point2f tl = -image.globalShift;
+    const Point2f br = tl + Point2f(size.width, size.height);
+    crop &= Rect(Point(cvCeil(tl.x), cvCeil(tl.y)),
+                 Point(cvFloor(br.x), cvFloor(br.y)));
+  }
+  return crop;
 }
 
 
 void globalRegistrator::getGlobalShifts(const registrationParams& params,
                                         registrationContext& context,
                                         const Mat& refimg,
-                                        const bool showProgress) {
+                                        const bool showProgress,
+                                        meanAccumulator* refimgSum) {
+  registerImages(params, context, refimg, frameRange(context.images().size()),
+                 showProgress, refimgSum);
+
+  context.commonRectangle(commonRectangle(context.images(), refimg.size()));
+}
+
+
+void globalRegistrator::registerImages(const registrationParams& params,
+                                       registrationContext& context,
+                                       const Mat& refimg,
+                                       const std::vector<int>& indices,
+                                       const bool showProgress,
+                                       meanAccumulator* refimgSum) {
+  struct preregJob {
+    int index;
+    Mat pixels;
+    Mat color;
+  };
+  framePipeline<preregJob> pipeline(params.readAhead());
+
+  // decoding
+  pipeline.addStage(params.ioThreads(), [&](preregJob& job, int) {
+    if (refimgSum)
+      job.color = readFrame(context.images().at(job.index), &job.pixels);
+    else
+      job.pixels = readGrayFrame(context.images().at(job.index));
+  });
+
+  // registration; the reference is prepared once and shared, while each
+  // worker needs its own registrator (that is, working buffers), which is
+  // created on first use
+  auto reference = std::make_shared<const globalReference>(
+    refimg, params.prereg_maxmove, params.prereg_pyramid, params.prereg_engine);
+  std::vector<std::unique_ptr<globalRegistrator>> registrators(params.computeThreads());
+  pipeline.addStage(params.computeThreads(), [&](preregJob& job, int worker) {
+    if (!registrators[worker])
+      registrators[worker].reset(new globalRegistrator(reference));
+    registrators[worker]->findShift(context.images().at(job.index), job.pixels);
+    job.pixels.release();
+    if (refimgSum) {
+      refimgSum->add(context.images().at(job.index), job.color);
+      job.color.release();
+    }
+  });
+
+  // progress indication
   int progress = 0;
+  pipeline.addStage(1, [&](preregJob&, int) {
+    if (showProgress)
+      std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, indices.size());
+  });
+
   if (showProgress)
-    std::fprintf(stderr, "0/%ld", context.images().size());
-  #pragma omp parallel
-  {
-    grayReader reader;
-    globalRegistrator globalReg(refimg, params.prereg_maxmove);
-    #pragma omp for schedule(dynamic)
-    for (int ifile = 0; ifile < (signed)context.images().size(); ifile++) {
-      auto& image = context.images().at(ifile);
-      Mat pixels(reader.read(image.filename));
-      globalReg.findShift(image, pixels);
-
-      if (showProgress) {
-        #pragma omp critical
-        std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, context.images().size());
-      }
-    }
-  }
+    std::fprintf(stderr, "0/%ld", indices.size());
+  pipeline.run(indices);
   if (showProgress)
     std::fprintf(stderr, "\n");
+}
 
-  Rect crop(Point(0, 0), refimg.size());
-  for (auto& image : context.images()) {
-        crop &= Rect(-image.globalShift, refimg.size());
+
+// Centroid pre-registration
+//
+// Each image is reduced to the brightness-weighted centroid of the pixels
+// that are brighter than the mean of the image; for a planet on a black sky,
+// the mean lies well above the background, but below the planet's disk, so
+// this suppresses the influence of noise in the background. The images are
+// then shifted so that their centroids coincide with the average centroid,
+// and the multiplier is the ratio of the image's flux above the mean to the
+// average of that flux over all images.
+//
+void globalRegistrator::getCentroidShifts(const registrationParams& params,
+                                          registrationContext& context,
+                                          const bool showProgress) {
+  const size_t count = context.images().size();
+  std::vector<Point2f> centroids(count);
+  std::vector<double> fluxes(count);
+
+  struct centroidJob {
+    int index;
+    Mat pixels;
+  };
+  framePipeline<centroidJob> pipeline(params.readAhead());
+
+  // decoding
+  pipeline.addStage(params.ioThreads(), [&](centroidJob& job, int) {
+    job.pixels = readGrayFrame(context.images().at(job.index));
+  });
+
+  // centroid calculation
+  pipeline.addStage(params.computeThreads(), [&](centroidJob& job, int) {
+    Mat1f excess = job.pixels - mean(job.pixels)[0];
+    excess = max(excess, 0.0);
+    Moments m = moments(excess);
+    fluxes.at(job.index) = m.m00;
+    if (m.m00 > 0)
+      centroids.at(job.index) = Point2f(m.m10 / m.m00, m.m01 / m.m00);
+    else
+      centroids.at(job.index) = Point2f(job.pixels.cols, job.pixels.rows) * 0.5f;
+    job.pixels.release();
+  });
+
+  // progress indication
+  int progress = 0;
+  pipeline.addStage(1, [&](centroidJob&, int) {
+    if (showProgress)
+      std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, count);
+  });
+
+  if (showProgress)
+    std::fprintf(stderr, "0/%ld", count);
+  pipeline.run(frameRange(count));
+  if (showProgress)
+    std::fprintf(stderr, "\n");
+
+  Point2f meanCentroid(0, 0);
+  double meanFlux = 0;
+  for (size_t i = 0; i < count; i++) {
+    meanCentroid += centroids[i] * (1.0f / count);
+    meanFlux += fluxes[i] / count;
   }
-  context.commonRectangle(crop);
+
+  for (size_t i = 0; i < count; i++) {
+    inputImage& image = context.images().at(i);
+    image.globalShift = centroids[i] - meanCentroid;
+    image.globalMultiplier = meanFlux > 0 ? fluxes[i] / meanFlux : 1;
+  }
+
+  context.commonRectangle(commonRectangle(context.images(), context.imagesize()));
 }
@@ -19,18 +19,59 @@
 #ifndef GLOBALREGISTRATOR_H
 #define GLOBALREGISTRATOR_H
 
+#include <memory>
 #include "imageops.h"
+#include "cookedtemplate.h"
 #include "registrationparams.h"
 #include "registrationcontext.h"
 
-// globalRegistrator is a tool that initially takes a template image and can
-// then sequentially register any number of images against that template. The
-// class should not be used directly because of its non-thread-safeness, but
-// rather via the static method getGlobalShifts() that performs a parallelized
-// registration of multiple images.
+// The reference part of global registration: the reference image, padded
+// by maxmove on all sides, and everything that is derived from it. It is
+// computed once and only read afterwards, so a single instance is shared by
+// all threads.
+//
+// With pyramidLevels > 0, the shift is first estimated on images that are
+// downsampled pyramidLevels times by a factor of two (against the coarse
+// reference) and then refined at full resolution in a small window around
+// the estimate.
+//
+// The spectral engine correlates the images with precomputed spectra of the
+// reference (see cookedReference) instead of calling matchTemplate().
+class globalReference {
+public:
+  typedef registrationParams::preregEngineType engineType;
+
+  globalReference(const cv::Mat& reference, const int maxmove,
+                  const int pyramidLevels = 0,
+                  const engineType engine = engineType::MatchTemplate);
+
+  cv::Mat1f refImgWithBorder;
+  cv::Mat1f refImageArea;
+  // Sum of squares of the reference under the image at each position; not
+  // needed (and left empty) at full resolution in pyramid mode.
+  cv::Mat1f areasq;
+  cv::Point originShift;
+  int maxmove;
+
+  // spectral engine
+  std::unique_ptr<const cookedReference> refSpectrum;
+  std::unique_ptr<const cookedReference> areaSpectrum;
+
+  // pyramid mode
+  int pyramidLevels;
+  std::unique_ptr<const globalReference> coarse;
+};
+
+
+// globalRegistrator is a tool that takes a reference and can then
+// sequentially register any number of images against it. It only holds
+// working buffers of its own. The class should not be used directly because
+// of its non-thread-safeness, but rather via the static method
+// getGlobalShifts() that runs the registration of multiple images through a
+// parallel processing pipeline.
 class globalRegistrator {
 public:
-  globalRegistrator(const cv::Mat& reference, const int maxmove);
+  globalRegistrator(std::shared_ptr<const globalReference> reference);
 
 private:
   // Not thread safe.
@@ -38,22 +79,53 @@ private:
   // to call this method. See getGlobalShifts().
   void findShift(inputImage& image, const cv::Mat& pixels);
 
-  cv::Mat1f refImgWithBorder;
-  cv::Mat1f refImageArea;
-  cv::Mat1f searchMask;
-  cv::Mat1f areasq;
+  // Both return the position of the best match in refImgWithBorder of the
+  // given level and the corresponding multiplier. fullSearch() tries all
+  // possible positions, localSearch() only those within radius from the
+  // given one. The position is refined to subpixel precision.
+  cv::Point2f fullSearch(const globalReference& level, const cv::Mat& pixels,
+                         float& multiplier);
+  cv::Point2f localSearch(const globalReference& level, const cv::Mat& pixels,
+                          cv::Point center, int radius, float& multiplier);
+  // Subpixel position of the minimum of match.
+  cv::Point2f matchMinimum(const cv::Mat1f& areasq, float& multiplier) const;
+
+  std::shared_ptr<const globalReference> ref;
+
+  // working buffers
   cv::Mat1f imgsq;
   cv::Mat1f cor;
   cv::Mat1f match;
-  cv::Point originShift;
+  cv::Mat workspace;
+  cv::Mat1f windowAreasq;
+  cv::Mat1d windowsq;
 
 public:
   // Parallelized static method that registers a set of images and stores
   // the results into the registration context.
+  // If refimgSum is given, the (color) images are also added to it as soon
+  // as their shifts are known; this saves a separate pass of meanimg().
   static void getGlobalShifts(const registrationParams& params,
                               registrationContext& context,
                               const cv::Mat& refimg,
-                              bool showProgress);
+                              bool showProgress,
+                              meanAccumulator* refimgSum = nullptr);
+
+  // Fast alternative to getGlobalShifts() that needs no reference: the
+  // images are aligned on their brightness centroids (see the source for
+  // details). Also sets commonRectangle.
+  static void getCentroidShifts(const registrationParams& params,
+                                registrationContext& context,
+                                bool showProgress);
+
+  // Registers only the given images (indices into context.images()) and
+  // leaves the rest of the context, including commonRectangle, untouched.
+  static void registerImages(const registrationParams& params,
+                             registrationContext& context,
+                             const cv::Mat& refimg,
+                             const std::vector<int>& indices,
+                             bool showProgress,
+                             meanAccumulator* refimgSum = nullptr);
 };
 
 #endif // GLOBALREGISTRATOR_H
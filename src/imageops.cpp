@@ -19,30 +19,54 @@
 #include <cstdio>
 #include <iostream>
 #include <limits>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cctype>
 #include <Magick++.h>
 #include <boost/filesystem.hpp>
 #include "imageops.h"
 #include "globalregistrator.h"
+#include "framesource.h"
+#include "fitssource.h"
+#include "pipeline.h"
 
 using namespace cv;
 
+bool hasExtension(const std::string& filename, const std::string& ext) {
+  if (filename.length() < ext.length())
+    return false;
+  std::string fileExt(filename.cend() - ext.length(), filename.cend());
+  std::transform(fileExt.begin(), fileExt.end(), fileExt.begin(), ::tolower);
+  return fileExt == ext;
+}
+
+
 Mat magickImread(const std::string& filename)
 {
   Magick::Image image;
   image.read(filename);
-  cv::Mat output;
 
-  if (image.colorSpace() == Magick::GRAYColorspace) {
-    output = cv::Mat(image.rows(), image.columns(), CV_32F);
-    image.write(0, 0, image.columns(), image.rows(),
-                "I", Magick::FloatPixel, output.data);
+  const bool gray = image.colorSpace() == Magick::GRAYColorspace;
+  const std::string map = gray ? "I" : "BGR";
+  const int channels = gray ? 1 : 3;
+  cv::Mat output(image.rows(), image.columns(), CV_MAKETYPE(CV_32F, channels));
+
+  if (image.depth() <= 16) {
+    // Integer samples: export them as such (which is also half the data of
+    // the float export) and linearize them via a lookup table.
+    const bool eightBit = image.depth() <= 8;
+    cv::Mat raw(image.rows(), image.columns(),
+                CV_MAKETYPE(eightBit ? CV_8U : CV_16U, channels));
+    image.write(0, 0, image.columns(), image.rows(), map,
+                eightBit ? Magick::CharPixel : Magick::ShortPixel, raw.data);
+    sRGB2linearRGB(raw, output);
   }
   else {
-    output = cv::Mat(image.rows(), image.columns(), CV_32FC3);
     image.write(0, 0, image.columns(), image.rows(),
-                  "BGR", Magick::FloatPixel, output.data);
+                map, Magick::FloatPixel, output.data);
+    sRGB2linearRGB(output);
   }
-  sRGB2linearRGB(output);
   return output;
 }
 
@@ -77,14 +101,35 @@ std::string generateTestFilename(const std::string& origPath) {
 }
 
 
+void writeOutputImage(const std::string& filename, const Mat& image) {
+  if (isFitsFile(filename))
+    writeFits32F(filename, image);
+  else
+    magickImwrite16U(filename, normalizeTo16Bits(image));
+}
+
+
 void writeTestImage(const std::string& path) {
-  Magick::Image img(Magick::Geometry(1, 1), Magick::ColorGray(1.0));
   std::string testfile(generateTestFilename(path));
-  img.write(testfile);
+  if (isFitsFile(path)) {
+    // FITS files are written by us, not by ImageMagick.
+    std::ofstream test(testfile);
+    if (!test)
+      throw std::runtime_error("cannot create '" + testfile + "'");
+  }
+  else {
+    Magick::Image img(Magick::Geometry(1, 1), Magick::ColorGray(1.0));
+    img.write(testfile);
+  }
   std::remove(testfile.c_str());
 }
 
 
+static inline float sRGB2linear(double value) {
+  return value <= 0.04045 ? value/12.92 : pow((value + 0.055)/1.055, 2.4);
+}
+
+
 void sRGB2linearRGB(Mat& img) {
   int rows = img.rows;
   int cols = img.cols;
@@ -97,13 +142,57 @@ void sRGB2linearRGB(Mat& img) {
   {
     float* ptr = img.ptr<float>(row);
     for (int i = 0; i < cols*channels; i++) {
-      *ptr = (*ptr <= 0.04045 ? *ptr/12.92 : pow((*ptr + 0.055)/1.055, 2.4));
+      *ptr = sRGB2linear(*ptr);
       ptr++;
     }
   }
 }
 
 
+// Table of linear values for all possible sample values of type T.
+template <typename T>
+static const float* sRGB2linearTable() {
+  static const std::vector<float> table = [] {
+    const int size = std::numeric_limits<T>::max() + 1;
+    std::vector<float> t(size);
+    for (int i = 0; i < size; i++)
+      t[i] = sRGB2linear(i/(double)(size - 1));
+    return t;
+  }();
+  return table.data();
+}
+
+
+template <typename T>
+static void sRGB2linearLUT(const Mat& src, Mat& dst) {
+  const float* table = sRGB2linearTable<T>();
+  int rows = src.rows;
+  int cols = src.cols;
+  int channels = src.channels();
+  if (src.isContinuous() && dst.isContinuous()) {
+    cols *= rows;
+    rows = 1;
+  }
+  for(int row = 0; row < rows; row++)
+  {
+    const T* srcptr = src.ptr<T>(row);
+    float* dstptr = dst.ptr<float>(row);
+    for (int i = 0; i < cols*channels; i++)
+      dstptr[i] = table[srcptr[i]];
+  }
+}
+
+
+void sRGB2linearRGB(const Mat& src, Mat& dst) {
+  CV_Assert(src.depth() == CV_8U || src.depth() == CV_16U);
+  dst.create(src.size(), CV_MAKETYPE(CV_32F, src.channels()));
+  if (src.depth() == CV_8U)
+    sRGB2linearLUT<uchar>(src, dst);
+  else
+    sRGB2linearLUT<ushort>(src, dst);
+}
+
+
 void linearRGB2sRGB(Mat& img) {
   int rows = img.rows;
   int cols = img.cols;
@@ -123,20 +212,6 @@ void linearRGB2sRGB(Mat& img) {
 }
 
 
-Mat grayReader::read(const std::string& file) {
-  Mat img = magickImread(file.c_str());
-  if (img.channels() > 1) {
-    // colour image: convert to gray
-    cvtColor(img, imggray, COLOR_BGR2GRAY);
-    return imggray;
-  }
-  else {
-    // already gray
-    return img;
-  }
-}
-
-
 void divideChannelsByMask(Mat& image, Mat& mask)
 {
   int rows = image.rows;
@@ -158,47 +233,190 @@ void divideChannelsByMask(Mat& image, Mat& mask)
 }
 
 
-Mat meanimg(const registrationContext& context,
+Mat translateImage(const Mat& img, const Point2f shift, const int borderMode) {
+  Mat translated;
+  translateImage(img, translated, shift, borderMode);
+  return translated;
+}
+
+
+void translateImage(const Mat& img, Mat& translated, const Point2f shift,
+                    const int borderMode) {
+  const double transform[] = {1, 0, shift.x, 0, 1, shift.y};
+  warpAffine(img, translated, Mat(2, 3, CV_64F, (void*)transform), img.size(),
+             INTER_LINEAR | WARP_INVERSE_MAP, borderMode, Scalar::all(0));
+}
+
+
+meanAccumulator::meanAccumulator(const Size imagesize, const int channels) :
+  imgRect(Point(0, 0), imagesize), ones(imagesize, 1.0f),
+  sum(imagesize, channels) {}
+
+
+void meanAccumulator::add(const inputImage& image, const Mat& data)
+{
+  const Point2f shift = image.globalShift;
+  if (shift.x == cvFloor(shift.x) && shift.y == cvFloor(shift.y)) {
+    const Point intShift(shift);
+    Rect sourceRoi = (imgRect + intShift) & imgRect;
+    Rect destRoi = sourceRoi - intShift;
+    sum.add(data(sourceRoi), Mat(), image.globalMultiplier, destRoi.tl());
+  }
+  else {
+    // Images with a fractional global shift are interpolated, along with
+    // their contribution to the normalization.
+    sum.add(translateImage(data, shift), translateImage(ones, shift),
+            image.globalMultiplier);
+  }
+}
+
+
+Mat meanAccumulator::mean()
+{
+  divideChannelsByMask(sum.sum(), sum.normalization());
+  return sum.sum();
+}
+
+
+Mat meanimg(const registrationParams& params,
+            const registrationContext& context,
             const bool showProgress) {
   const auto& images = context.images();
+  meanAccumulator accumulator(context.imagesize(), context.imagechannels());
+
+  struct meanJob {
+    int index;
+    Mat data;
+  };
+  framePipeline<meanJob> pipeline(params.readAhead());
+
+  // decoding
+  pipeline.addStage(params.ioThreads(), [&](meanJob& job, int) {
+    job.data = readFrame(images.at(job.index));
+  });
+
+  // accumulation
+  pipeline.addStage(params.computeThreads(), [&](meanJob& job, int) {
+    accumulator.add(images.at(job.index), job.data);
+    job.data.release();
+  });
+
+  // progress indication
+  int progress = 0;
+  pipeline.addStage(1, [&](meanJob&, int) {
+    if (showProgress)
+      std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, images.size());
+  });
+
+  if (showProgress)
+    std::fprintf(stderr, "0/%ld", images.size());
+  pipeline.run(frameRange(images.size()));
+  if (showProgress)
+    std::fprintf(stderr, "\n");
 
-  Mat sample = magickImread(images.at(0).filename);
-  Rect imgRect(Point(0, 0), sample.size());
-  Mat imgmean = Mat::zeros(sample.size(), CV_MAKETYPE(CV_32F, sample.channels()));
-  Mat normalizationMask = Mat::zeros(sample.size(), CV_32F);
+  return accumulator.mean();
+}
 
+
+// Image quality is the energy of the Laplacian (i.e. of fine detail),
+// relative to the square of the mean brightness. The image is slightly
+// blurred beforehand so that the estimate is not dominated by pixel noise.
+float imageQuality(const Mat& gray) {
+  Mat1f smooth, laplacian;
+  GaussianBlur(gray, smooth, Size(0, 0), 1.0);
+  Laplacian(smooth, laplacian, CV_32F);
+  const double brightness = mean(gray)[0];
+  if (brightness <= 0)
+    return 0;
+  return mean(laplacian.mul(laplacian))[0] / (brightness*brightness);
+}
+
+
+void gradeImages(const registrationParams& params,
+                 registrationContext& context,
+                 const bool showProgress) {
+  auto& images = context.images();
+
+  struct gradeJob {
+    int index;
+    Mat pixels;
+  };
+  framePipeline<gradeJob> pipeline(params.readAhead());
+
+  // decoding
+  pipeline.addStage(params.ioThreads(), [&](gradeJob& job, int) {
+    job.pixels = readGrayFrame(images.at(job.index));
+  });
+
+  // grading
+  pipeline.addStage(params.computeThreads(), [&](gradeJob& job, int) {
+    images.at(job.index).quality = imageQuality(job.pixels);
+    job.pixels.release();
+  });
+
+  // progress indication
   int progress = 0;
+  pipeline.addStage(1, [&](gradeJob&, int) {
+    if (showProgress)
+      std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, images.size());
+  });
+
   if (showProgress)
     std::fprintf(stderr, "0/%ld", images.size());
-  #pragma omp parallel
-  {
-    Mat localsum(imgmean.clone());
-    Mat localNormMask(normalizationMask.clone());
-    #pragma omp barrier
-    #pragma omp for
-    for (int i = 0; i < (signed)images.size(); i++) {
-      auto image = images.at(i);
-      Mat data = magickImread(image.filename);
-
-      Rect sourceRoi = (imgRect + image.globalShift) & imgRect;
-      Rect destRoi = sourceRoi - image.globalShift;
-      accumulate(data(sourceRoi), localsum(destRoi));
-      localNormMask(destRoi) += image.globalMultiplier;
-
-      if (showProgress) {
-        #pragma omp critical
-        std::fprintf(stderr, "\r\033[K%d/%ld", ++progress, images.size());
-      }
-    }
-    #pragma omp critical
-    accumulate(localsum, imgmean);
-    accumulate(localNormMask, normalizationMask);
-  }
+  pipeline.run(frameRange(images.size()));
   if (showProgress)
     std::fprintf(stderr, "\n");
+}
 
-  divideChannelsByMask(imgmean, normalizationMask);
-  return imgmean;
+
+std::vector<bool> sharpestImages(const std::vector<inputImage>& images,
+                                 const size_t keep) {
+  std::vector<int> order = frameRange(images.size());
+  std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+    return images[a].quality > images[b].quality;
+  });
+  std::vector<bool> selected(images.size(), false);
+  for (size_t i = 0; i < std::min(keep, order.size()); i++)
+    selected[order[i]] = true;
+  return selected;
+}
+
+
+bool selectBestImages(const registrationParams& params,
+                      registrationContext& context) {
+  const auto& images = context.images();
+  for (const auto& image : images)
+    if (image.quality < 0)
+      return false;
+
+  size_t keep = images.size();
+  if (params.keep_best > 0)
+    keep = std::min<size_t>(params.keep_best, images.size());
+  else if (params.keep_percent > 0)
+    keep = std::max<size_t>(std::lround(images.size() * params.keep_percent / 100), 1);
+  if (keep == images.size())
+    return true;
+
+  // Indices of the sharpest images, in their original order.
+  const std::vector<bool> sharpest = sharpestImages(images, keep);
+  std::vector<int> order;
+  for (size_t i = 0; i < images.size(); i++)
+    if (sharpest[i])
+      order.push_back(i);
+
+  std::vector<inputImage> selected;
+  for (int i : order)
+    selected.push_back(images[i]);
+  if (context.shifts.valid()) {
+    std::vector<Mat1f> selectedShifts;
+    for (int i : order)
+      selectedShifts.push_back(context.shifts().at(i));
+    context.shifts(selectedShifts);
+  }
+  context.images(selected);
+  // commonRectangle remains valid: the selected images cover at least that
+  // much. Keeping it also keeps the registration points valid.
+  return true;
 }
 
 
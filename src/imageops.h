@@ -25,32 +25,80 @@
 #include <string>
 #include "registrationparams.h"
 #include "registrationcontext.h"
+#include "tiledaccumulator.h"
 
-class grayReader {
-public:
-  // NOT THREAD SAFE!
-  cv::Mat read(const std::string& file);
-
-private:
-  cv::Mat1f imggray;
-};
+// Case-insensitive check of the file name extension (ext includes the dot).
+bool hasExtension(const std::string& filename, const std::string& ext);
 
 cv::Mat magickImread(const std::string& filename);
 
 // Write a matrix of type CV_16U or CV_16UC3 to file via imageMagick.
 void magickImwrite16U(const std::string& filename, const cv::Mat& cvImage);
 
+// Writes the final (linear) image. FITS files receive the data as 32-bit
+// floats; other formats are normalized to 16 bits and written via
+// ImageMagick.
+void writeOutputImage(const std::string& filename, const cv::Mat& image);
+
 void writeTestImage(const std::string& path);
 
 void sRGB2linearRGB(cv::Mat& img);
 
+// Converts 8- or 16-bit sRGB samples to linear float through a lookup table.
+void sRGB2linearRGB(const cv::Mat& src, cv::Mat& dst);
+
 void linearRGB2sRGB(cv::Mat& img);
 
 void divideChannelsByMask(cv::Mat& image, cv::Mat& mask);
 
-cv::Mat meanimg(const registrationContext& context,
+// Returns an image of the same size whose pixel at p is img(p + shift),
+// interpolated bilinearly.
+cv::Mat translateImage(const cv::Mat& img, const cv::Point2f shift,
+                       const int borderMode = cv::BORDER_CONSTANT);
+// The same, into an existing matrix (which is reused if possible).
+void translateImage(const cv::Mat& img, cv::Mat& translated,
+                    const cv::Point2f shift,
+                    const int borderMode = cv::BORDER_CONSTANT);
+
+// Sums images at their global shifts, weighted for a mean image. add() may
+// be called from any number of threads at once.
+class meanAccumulator
+{
+public:
+  meanAccumulator(const cv::Size imagesize, const int channels);
+  void add(const inputImage& image, const cv::Mat& data);
+  cv::Mat mean();
+
+private:
+  cv::Rect imgRect;
+  cv::Mat1f ones;
+  tiledAccumulator sum;
+};
+
+cv::Mat meanimg(const registrationParams& params,
+                const registrationContext& context,
                 const bool showProgress = false);
 
+// Sharpness of an image, independent of its brightness.
+float imageQuality(const cv::Mat& gray);
+
+// Stores imageQuality() of every image into the context.
+void gradeImages(const registrationParams& params,
+                 registrationContext& context,
+                 const bool showProgress = false);
+
+// Marks the keep sharpest images (according to their quality, which must be
+// known).
+std::vector<bool> sharpestImages(const std::vector<inputImage>& images,
+                                 size_t keep);
+
+// Reduces the images in the context to the sharpest ones, as requested by
+// --keep-best or --keep-percent, together with their data (global
+// registration, dedistortion shifts). Returns false if the images have not
+// been graded.
+bool selectBestImages(const registrationParams& params,
+                      registrationContext& context);
+
 cv::Mat normalizeTo16Bits(const cv::Mat& inputImg);
 
 class imageSumLookup
@@ -17,6 +17,7 @@
  */
 
 #include "imagepatch.h"
+#include "xcorwisdom.h"
 
 imagePatchPosition::imagePatchPosition(int xpos, int ypos, cv::Rect search) :
   x(xpos), y(ypos), searchArea(search) {}
@@ -62,16 +63,35 @@ bool imagePatchPosition::searchAreaOverlaps(const cv::Rect rect) const
 }
 
 
-imagePatch::imagePatch(cv::Mat img, imagePatchPosition position, int boxsize) :
+imagePatch::imagePatch(cv::Mat img, imagePatchPosition position, int boxsize,
+                       int spectralDepth) :
   imagePatchPosition(position),
   image(img(cv::Rect((int)position.x, (int)position.y, boxsize, boxsize))),
-  sqsum(sum(image.mul(image))[0]), cookedTmpl(image, position.searchArea.size()),
-  cookedMask(cv::Mat::ones(image.size(), CV_32F), position.searchArea.size()),
-  cookedSquare(image.mul(image), position.searchArea.size()) {}
+  sqsum(sum(image.mul(image))[0]),
+  lazy(std::make_shared<lazySpectra>(spectralDepth)) {}
 
 
-imagePatch::imagePatch(cv::Mat img, int xpos, int ypos, int boxsize, cv::Rect search) :
-  imagePatch(img, imagePatchPosition(xpos, ypos, search), boxsize) {}
+imagePatch::imagePatch(cv::Mat img, int xpos, int ypos, int boxsize, cv::Rect search,
+                       int spectralDepth) :
+  imagePatch(img, imagePatchPosition(xpos, ypos, search), boxsize, spectralDepth) {}
+
+
+imagePatch::cookedSpectra::cookedSpectra(const cv::Mat& image, cv::Size searchSize,
+                                         int depth, const xcorOptions& options) :
+  tmpl(image, searchSize, depth, options),
+  square(image.mul(image), searchSize, depth, options) {}
+
+
+const imagePatch::cookedSpectra& imagePatch::cooked() const
+{
+  std::call_once(lazy->once, [this]() {
+    xcorOptions options;
+    if (xcorWisdom* wisdom = xcorWisdom::instance())
+      options = wisdom->options(image.size(), searchArea.size(), lazy->depth);
+    lazy->spectra.reset(new cookedSpectra(image, searchArea.size(), lazy->depth, options));
+  });
+  return *lazy->spectra;
+}
 
 
 cv::Rect patchCollection::searchAreaForImage(const cv::Rect imageRect) const
@@ -19,6 +19,8 @@
 #ifndef IMAGEPATCH_H
 #define IMAGEPATCH_H
 
+#include <memory>
+#include <mutex>
 #include <opencv2/core/core.hpp>
 #include "cookedtemplate.h"
 
@@ -42,19 +44,46 @@ void write(cv::FileStorage& fs,
 
 class imagePatch : public imagePatchPosition {
 public:
-  imagePatch(cv::Mat img, imagePatchPosition position, int boxsize);
-  imagePatch(cv::Mat img, int xpos, int ypos, int boxsize, cv::Rect search);
+  // The spectral depth (CV_64F or CV_32F) is the depth of the cooked
+  // templates; see cookedXcor.
+  imagePatch(cv::Mat img, imagePatchPosition position, int boxsize,
+             int spectralDepth = CV_64F);
+  imagePatch(cv::Mat img, int xpos, int ypos, int boxsize, cv::Rect search,
+             int spectralDepth = CV_64F);
 
   cv::Point2f center() const
     { return cv::Point2f(x + (image.cols-1)/2.0, y + (image.rows-1)/2.0); }
   int matchShiftx() const { return x - searchArea.x; }
   int matchShifty() const { return y - searchArea.y; }
 
+  // The cooked templates are only needed for patch matching, so they are
+  // computed on first use (safely from any number of threads). Copies of
+  // a patch share them.
+  const cookedTemplate& cookedTmpl() const { return cooked().tmpl; }
+  const cookedTemplate& cookedSquare() const { return cooked().square; }
+  int spectralDepth() const { return lazy->depth; }
+
   cv::Mat image;
   double sqsum;
-  cookedTemplate cookedTmpl;
-  cookedTemplate cookedMask;
-  cookedTemplate cookedSquare;
+
+private:
+  struct cookedSpectra {
+    cookedSpectra(const cv::Mat& image, cv::Size searchSize, int depth,
+                  const xcorOptions& options);
+    cookedTemplate tmpl;
+    cookedTemplate square;
+  };
+
+  struct lazySpectra {
+    lazySpectra(int depth_) : depth(depth_) {}
+    int depth;
+    std::once_flag once;
+    std::unique_ptr<const cookedSpectra> spectra;
+  };
+
+  const cookedSpectra& cooked() const;
+
+  std::shared_ptr<lazySpectra> lazy;
 };
 
 
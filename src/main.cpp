@@ -21,14 +21,17 @@
 #include <vector>
 #include <string>
 #include <algorithm>
-#include <omp.h>
 #include <Magick++.h>
 #include "imageops.h"
+#include "framesource.h"
+#include "framecache.h"
 #include "dedistort.h"
 #include "globalregistrator.h"
 #include "rbfwarper.h"
 #include "registrationparams.h"
 #include "registrationcontext.h"
+#include "statefile.h"
+#include "xcorwisdom.h"
 
 using namespace cv;
 
@@ -38,15 +41,20 @@ int main(const int argc, const char *argv[]) {
   if (!params.parse(argc, argv))
     return 1;
 
-  // This should be called in order for OpenMP parallelization to work with
+  // This should be called in order for multithreading to work with
   // ImageMagick.
   Magick::InitializeMagick(NULL);
+  // Images are decoded in parallel by our own pipelines; ImageMagick's
+  // internal threads would only compete with them.
+  MagickCore::SetMagickResourceLimit(MagickCore::ThreadResource, 1);
 
-  registrationContext context;
+  if (!params.frame_cache.empty())
+    frameCache::enable(params.frame_cache, params.frame_cache_storage);
+
+  if (!params.wisdom_file.empty())
+    xcorWisdom::enable(params.wisdom_file);
 
-  // Resolve stage dependencies.
-  bool need_patches = params.stage_patches || params.stage_dedistort;
-  bool need_refimg = params.stage_refimg || need_patches;
+  registrationContext context;
 
   // If an output image will be created, check whether the destination can
   // actually be written to.
@@ -54,9 +62,11 @@ int main(const int argc, const char *argv[]) {
     std::cerr << "Creating a dummy image to see if the destination is writable... ";
     try {
       writeTestImage(params.output_file);
+      for (const auto& output : params.extra_outputs)
+        writeTestImage(output.filename);
       std::cerr << "success.\n";
     }
-    catch (Magick::Exception& e) {
+    catch (std::exception& e) {
       std::cerr << "FAILED!\n"
       "Possible reasons include insufficient permissions for writing to the output\n"
       "directory or a failure to specify the output image format (missing file\n"
@@ -69,61 +79,176 @@ int main(const int argc, const char *argv[]) {
   // Load a state file if one was supplied.
   if (!params.read_state_file.empty()) {
     std::cerr << "Reading state from '" << params.read_state_file << "':\n";
-    FileStorage readStateFS(params.read_state_file, FileStorage::READ);
-    context = registrationContext(readStateFS);
+    context = readStateFile(params.read_state_file, params.spectralDepth());
     context.printReport();
     std::cerr << std::endl;
 
     if (context.boxsize.valid() && !params.boxsize_override)
       params.boxsize = context.boxsize();
+
+    // State files written by older versions lack some image properties.
+    if (context.images.valid() &&
+        !(context.imagechannels.valid() && context.imagedepth.valid())) {
+      frameInfo info = probeFrame(context.images().at(0));
+      context.imagechannels(info.channels);
+      context.imagedepth(info.bitDepth);
+    }
+
+    if (params.append) {
+      if (!context.images.valid()) {
+        std::cerr << "ERROR: the state file holds no images to append to\n";
+        return 1;
+      }
+      if (context.commonRectangle.valid() && !context.refimg.valid()) {
+        std::cerr << "ERROR: the state file holds pre-registration data but no reference\n"
+                     "       image to pre-register the appended images against\n";
+        return 1;
+      }
+
+      std::vector<inputImage> newImages = expandInputFiles(params.files);
+      for (const auto& image : newImages) {
+        frameInfo info = probeFrame(image);
+        if (info.size != context.imagesize() ||
+            info.channels != context.imagechannels()) {
+          std::cerr << "ERROR: '" << image.name() << "' does not match the size or "
+                       "the number of channels\n       of the images in the state file\n";
+          return 1;
+        }
+      }
+      std::cerr << "Appending " << newImages.size() << " images\n";
+
+      std::vector<int> newIndices;
+      std::vector<inputImage> images = context.images();
+      for (const auto& image : newImages) {
+        newIndices.push_back(images.size());
+        images.push_back(image);
+      }
+      context.images(images);
+
+      // The appended images are pre-registered against the existing
+      // reference image, which shares its coordinate system with the
+      // global shifts of the images that are already there. The common
+      // rectangle is kept as it is, so that the existing registration
+      // points remain valid.
+      if (context.commonRectangle.valid()) {
+        Mat globalRefimg = context.refimg();
+        if (params.prereg_maxmove == 0)
+          params.prereg_maxmove = std::min(globalRefimg.rows, globalRefimg.cols)/2;
+        std::cerr << "Pre-registering appended images on the reference image\n";
+        globalRegistrator::registerImages(params, context, globalRefimg, newIndices, true);
+      }
+
+      // Appended images need dedistortion shifts if the existing ones have
+      // them; stack() only computes the missing ones.
+      if (context.shifts.valid())
+        params.stage_dedistort = true;
+    }
   }
   else {
     // No state file - we are starting from scratch. Initialize registration
     // context from command line parameters.
-    std::vector<inputImage> images;
-    for (auto& file : params.files)
-      images.push_back(inputImage(file));
+    std::vector<inputImage> images = expandInputFiles(params.files);
     context.images(images);
-    std::cerr << context.images().size() << " input files listed on command line\n";
-    auto sampleFile = images.at(0).filename;
-    std::cerr << "Probing '" << sampleFile << "' for size... ";
-    Mat sample = magickImread(sampleFile);
-    context.imagesize(sample.size());
+    std::cerr << params.files.size() << " input files listed on command line";
+    if (images.size() != params.files.size())
+      std::cerr << " (" << images.size() << " frames)";
+    std::cerr << "\n";
+    auto sampleImage = images.at(0);
+    std::cerr << "Probing '" << sampleImage.name() << "' for size... ";
+    frameInfo info = probeFrame(sampleImage);
+    context.imagesize(info.size);
+    context.imagechannels(info.channels);
+    context.imagedepth(info.bitDepth);
     std::cerr << context.imagesize().width << "x"
               << context.imagesize().height << "\n";
   }
 
+  // Resolve stage dependencies. This is only done now because appending
+  // images may have enabled dedistortion.
+  const bool need_patches = params.stage_patches || params.stage_dedistort ||
+                            params.compare_precision > 0;
+  const bool need_refimg = params.stage_refimg || need_patches;
+
+  // Frame grading and selection: bad frames are dropped before any of the
+  // expensive work is done on them.
+  if (params.grade) {
+    std::cerr << "Grading images by sharpness\n";
+    gradeImages(params, context, true);
+  }
+  if (params.keep_best > 0 || params.keep_percent > 0) {
+    const size_t total = context.images().size();
+    if (!selectBestImages(params, context)) {
+      std::cerr << "ERROR: the images have not been graded (see --grade)\n";
+      return 1;
+    }
+    std::cerr << "Keeping the " << context.images().size()
+              << " sharpest of " << total << " images\n";
+  }
+  const bool graded = std::all_of(context.images().begin(), context.images().end(),
+                                  [](const inputImage& image) { return image.quality >= 0; });
+  for (const auto& output : params.extra_outputs) {
+    if (output.percent < 100 && !graded) {
+      std::cerr << "ERROR: --extra-output '" << output.filename << "' selects the sharpest\n"
+                   "       images, but the images have not been graded (see --grade)\n";
+      return 1;
+    }
+  }
+
+  // Color reference image; only created when needed (see below).
+  Mat rawRef;
+
   // preregistration stage
-  if (params.stage_prereg) {
+  if (params.stage_prereg && params.prereg == registrationParams::preregType::Centroid) {
+    std::cerr << "Pre-registering on image centroids\n";
+    globalRegistrator::getCentroidShifts(params, context, true);
+
+    // New global shifts invalidate any further data in the context.
+    std::cerr << "New pre-registration data obtained\n";
+    context.clearRefimgEtc();
+  }
+  else if (params.stage_prereg) {
+    inputImage preregRef(params.prereg_img);
     if (params.prereg == registrationParams::preregType::FirstImage)
-      params.prereg_img = context.images().at(0).filename;
+      preregRef = context.images().at(0);
     else if (params.prereg == registrationParams::preregType::MiddleImage)
     {
       // Select the middle image if the number of images is odd or the image
       // just before the middle if their number is even.
       int middle = (context.images().size() + 1)/ 2 - 1;
-      params.prereg_img = context.images().at(middle).filename;
+      preregRef = context.images().at(middle);
     }
 
-    Mat globalRefimg(grayReader().read(params.prereg_img));
+    Mat globalRefimg(readGrayFrame(preregRef));
     if (params.prereg_maxmove == 0) {
       params.prereg_maxmove = std::min(globalRefimg.rows, globalRefimg.cols)/2;
     }
-    std::cerr << "Pre-registering on reference '" << params.prereg_img << "'\n";
-    globalRegistrator::getGlobalShifts(params, context, globalRefimg, true);
+    // New global shifts invalidate the reference image, so if one is needed
+    // at all, it is stacked during pre-registration, in the same pass over
+    // the images.
+    std::cerr << "Pre-registering on reference '" << preregRef.name() << "'";
+    if (params.stage_refimg || params.only_refimg || need_refimg) {
+      std::cerr << " and creating a stacked reference image\n";
+      meanAccumulator refimgSum(context.imagesize(), context.imagechannels());
+      globalRegistrator::getGlobalShifts(params, context, globalRefimg, true, &refimgSum);
+      rawRef = refimgSum.mean();
+    }
+    else {
+      std::cerr << "\n";
+      globalRegistrator::getGlobalShifts(params, context, globalRefimg, true);
+    }
 
     // New global shifts invalidate any further data in the context.
     std::cerr << "New pre-registration data obtained\n";
     context.clearRefimgEtc();
   }
 
-  // reference image
-  Mat rawRef;
-  if (params.stage_refimg || params.only_refimg ||
-      (need_refimg && !context.refimg.valid())) {
+  // reference image (unless it was created during pre-registration)
+  if (rawRef.empty() &&
+      (params.stage_refimg || params.only_refimg ||
+       (need_refimg && !context.refimg.valid()))) {
     std::cerr << "Creating a stacked reference image\n";
     // This creates a color image. See below for implications.
-    rawRef = meanimg(context, true);
+    rawRef = meanimg(params, context, true);
   }
 
   if (params.only_refimg) {
@@ -137,7 +262,7 @@ int main(const int argc, const char *argv[]) {
       outputImage = rawRef(context.commonRectangle());
     }
     // This saves the color image.
-    magickImwrite16U(params.output_file, normalizeTo16Bits(outputImage));
+    writeOutputImage(params.output_file, outputImage);
   }
 
   // From now on, we will only store a black&white version of the reference
@@ -208,6 +333,29 @@ int main(const int argc, const char *argv[]) {
     context.clearShiftsEtc();
   }
 
+  // The coarse patches must still contain some detail.
+  const int minCoarseBoxsize = 8;
+  if (params.stage_dedistort && params.dedistort_pyramid > 0 &&
+      (context.boxsize() >> params.dedistort_pyramid) < minCoarseBoxsize) {
+    std::cerr << "ERROR: the boxsize (" << context.boxsize() << ") is too small for "
+              << params.dedistort_pyramid << " levels of --dedistort-pyramid\n";
+    return 1;
+  }
+
+  if (params.compare_precision > 0) {
+    std::cerr << "Comparing single and double precision patch matching\n";
+    comparePrecision(params, context);
+    return 0;
+  }
+
+  // Tune the matching up front rather than in the middle of the pipeline,
+  // where the timing would compete with the other workers.
+  if (params.stage_dedistort && xcorWisdom::instance()) {
+    std::cerr << "Tuning patch matching\n";
+    tuneXcor(params, context);
+  }
+
+  bool stoppedEarly = false;
   if (params.stage_dedistort || params.stage_stack) {
     if (params.stage_dedistort && params.stage_stack)
       std::cerr << "Dedistortion: registration, warping and stacking\n";
@@ -218,18 +366,30 @@ int main(const int argc, const char *argv[]) {
     else if (params.stage_stack)
       std::cerr << "Stacking images (no dedistortion)\n";
 
-    Mat finalsum = stack(params, context, true);
-    // Only save the result if there is something to save.
-    if (params.stage_stack) {
-      std::cerr << "Saving output to '" << params.output_file << "'\n";
-      magickImwrite16U(params.output_file, normalizeTo16Bits(finalsum));
+    // Only save the results if there is something to save.
+    const std::vector<Mat> results = stack(params, context, true, &stoppedEarly);
+    const auto outputs = params.outputs();
+    for (size_t i = 0; i < results.size(); i++) {
+      std::cerr << "Saving output to '" << outputs[i].filename << "'\n";
+      writeOutputImage(outputs[i].filename, results[i]);
     }
   }
 
   if (!params.save_state_file.empty()) {
     std::cerr << "Saving state to '" << params.save_state_file << "'\n";
-    FileStorage saveStateFS(params.save_state_file, FileStorage::WRITE);
-    context.write(saveStateFS);
+    writeStateFile(params.save_state_file, context);
+  }
+
+  // The results are safe now; a leftover checkpoint would only be mistaken
+  // for an interrupted run later on. A run that was stopped by the time
+  // budget or the frame limit is unfinished, though, and can be continued
+  // from it.
+  if (!params.checkpoint_file.empty()) {
+    if (stoppedEarly)
+      std::cerr << "Progress is kept in '" << params.checkpoint_file
+                << "'; use --resume to continue\n";
+    else
+      std::remove(params.checkpoint_file.c_str());
   }
 
   return 0;
@@ -0,0 +1,45 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <string>
+#include <cstddef>
+
+// A file mapped into memory in its entirety. The mapping is private: pages
+// that are written to are copied on write and never reach the file, so it is
+// safe to hand out pointers into the mapping to code that expects writable
+// memory (e.g. cv::Mat headers).
+class mappedFile {
+public:
+  mappedFile(const std::string& filename);
+  ~mappedFile();
+
+  mappedFile(const mappedFile&) = delete;
+  mappedFile& operator=(const mappedFile&) = delete;
+
+  unsigned char* data() const { return ptr; }
+  size_t size() const { return length; }
+
+private:
+  unsigned char* ptr = nullptr;
+  size_t length = 0;
+};
+
+#endif // MAPPEDFILE_H
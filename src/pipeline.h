@@ -0,0 +1,203 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+
+// A blocking FIFO queue with a fixed capacity that connects two stages of a
+// framePipeline.
+template <typename T>
+class boundedQueue {
+public:
+  boundedQueue(size_t capacity_) : capacity(capacity_ > 0 ? capacity_ : 1) {}
+
+  // Blocks while the queue is full. Returns false if the queue has been
+  // closed, in which case the item is discarded.
+  bool push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+    items.push_back(std::move(item));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks while the queue is empty. Returns false once the queue has been
+  // closed and all remaining items have been taken out.
+  bool pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+    if (items.empty())
+      return false;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  // No more items will be pushed; consumers drain what is left.
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+  // Like close(), but also discards the items that are still queued.
+  void abort() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    items.clear();
+    notEmpty.notify_all();
+    notFull.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::deque<T> items;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable notEmpty;
+  std::condition_variable notFull;
+};
+
+
+// framePipeline processes a list of frames through a sequence of stages.
+// Each stage has its own pool of worker threads and passes its jobs on to
+// the next stage through a bounded queue, so that slow stages (typically
+// decoding) overlap with the others without buffering an unbounded number
+// of frames in memory.
+//
+// Job must have a member "int index", which is set to the index of the frame
+// before the job enters the first stage. Stage functions receive the job and
+// the index of the worker thread within the stage (0 ... threads-1), which
+// can be used to select per-thread working data. A stage with a single
+// worker sees the jobs one at a time and needs no locking of its own; this
+// is the natural place for reductions and progress reporting.
+template <typename Job>
+class framePipeline {
+public:
+  typedef std::function<void(Job& job, int worker)> stageFunction;
+
+  framePipeline(size_t queueDepth_) : queueDepth(queueDepth_) {}
+
+  void addStage(int threads, stageFunction function) {
+    stages.push_back(stage{std::max(threads, 1), function});
+  }
+
+  // Runs all frames through the pipeline and blocks until they have been
+  // processed. If any stage throws, the pipeline is shut down and the first
+  // exception is rethrown here.
+  void run(const std::vector<int>& frames) {
+    stopRequested = false;
+    std::vector<std::unique_ptr<boundedQueue<Job>>> queues;
+    for (size_t s = 0; s < stages.size(); s++)
+      queues.emplace_back(new boundedQueue<Job>(queueDepth));
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<std::atomic<int>>> running;
+    for (size_t s = 0; s < stages.size(); s++) {
+      running.emplace_back(new std::atomic<int>(stages[s].threads));
+      for (int w = 0; w < stages[s].threads; w++) {
+        threads.emplace_back([this, s, w, &queues, &running] {
+          boundedQueue<Job>* input = queues[s].get();
+          boundedQueue<Job>* output = s + 1 < stages.size() ? queues[s+1].get() : nullptr;
+          try {
+            Job job;
+            while (input->pop(job)) {
+              stages[s].function(job, w);
+              if (output)
+                output->push(std::move(job));
+            }
+          }
+          catch (...) {
+            fail(std::current_exception(), queues);
+          }
+          // The last worker of a stage lets the next stage know that no
+          // more jobs are coming.
+          if (--*running[s] == 0 && output)
+            output->close();
+        });
+      }
+    }
+
+    for (int frame : frames) {
+      if (stopRequested)
+        break;
+      Job job;
+      job.index = frame;
+      if (!queues.front()->push(std::move(job)))
+        break;
+    }
+    queues.front()->close();
+
+    for (auto& thread : threads)
+      thread.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // Stops feeding new frames into the pipeline. Frames that have already
+  // entered it are processed to the end. Can be called from any stage.
+  void stop() { stopRequested = true; }
+
+private:
+  void fail(std::exception_ptr e,
+            std::vector<std::unique_ptr<boundedQueue<Job>>>& queues) {
+    {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (!error)
+        error = e;
+    }
+    for (auto& queue : queues)
+      queue->abort();
+  }
+
+  struct stage {
+    int threads;
+    stageFunction function;
+  };
+
+  const size_t queueDepth;
+  std::vector<stage> stages;
+  std::atomic<bool> stopRequested{false};
+  std::exception_ptr error;
+  std::mutex errorMutex;
+};
+
+// Indices of all frames, in order: 0, 1, ..., count-1.
+inline std::vector<int> frameRange(int count) {
+  std::vector<int> frames(count);
+  for (int i = 0; i < count; i++)
+    frames[i] = i;
+  return frames;
+}
+
+#endif // PIPELINE_H
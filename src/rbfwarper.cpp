@@ -134,41 +134,53 @@ void rbfWarper::prepareBases() {
 
 std::pair<Mat, Mat>
 rbfWarper::warp(const Mat& image,
-                const Point& globalShift,
+                const Point2f& globalShift,
                 const Mat1f& shifts) const {
-  Mat xField, yField;
+  workspace ws;
+  return warp(image, globalShift, shifts, ws);
+}
+
+
+std::pair<Mat, Mat>
+rbfWarper::warp(const Mat& image,
+                const Point2f& globalShift,
+                const Mat1f& shifts,
+                workspace& ws) const {
+  const Rect target(targetOrigin, imagesize);
 
   if (!shifts.empty()) {
-    Mat1f weights(coeffs * shifts);
-    Mat xshiftPoints = Mat::zeros(basesRect.size(), CV_32F);
-    Mat yshiftPoints = Mat::zeros(basesRect.size(), CV_32F);
+    gemm(coeffs, shifts, 1, noArray(), 0, ws.weights);
+    const Mat1f& weights = ws.weights;
+    ws.xshiftPoints.create(basesRect.size(), CV_32F);
+    ws.yshiftPoints.create(basesRect.size(), CV_32F);
+    ws.xshiftPoints.setTo(0);
+    ws.yshiftPoints.setTo(0);
 
     for (int i = 0; i < (signed)patches.size(); i++) {
       Point baseCenter = patches.at(i).center() * supersampling;
       baseCenter -= basesRect.tl();
-      xshiftPoints.at<float>(baseCenter) = weights.at<float>(i, 0);
-      yshiftPoints.at<float>(baseCenter) = weights.at<float>(i, 1);
+      ws.xshiftPoints.at<float>(baseCenter) = weights.at<float>(i, 0);
+      ws.yshiftPoints.at<float>(baseCenter) = weights.at<float>(i, 1);
     }
 
-    Mat xshift(basesRect.size(), CV_32F);
-    Mat yshift(basesRect.size(), CV_32F);
-    sepFilter2D(xshiftPoints, xshift, -1, gaussianKernel, gaussianKernel,
+    sepFilter2D(ws.xshiftPoints, ws.xshift, CV_32F, gaussianKernel, gaussianKernel,
                 Point(-1,-1), 0, BORDER_CONSTANT);
-    sepFilter2D(yshiftPoints, yshift, -1, gaussianKernel, gaussianKernel,
+    sepFilter2D(ws.yshiftPoints, ws.yshift, CV_32F, gaussianKernel, gaussianKernel,
                 Point(-1,-1), 0, BORDER_CONSTANT);
 
-    xField = xshift(Rect(targetOrigin, imagesize)) + xshiftbase + globalShift.x;
-    yField = yshift(Rect(targetOrigin, imagesize)) + yshiftbase + globalShift.y;
+    add(ws.xshift(target), xshiftbase, ws.xField);
+    add(ws.yshift(target), yshiftbase, ws.yField);
+    ws.xField += globalShift.x;
+    ws.yField += globalShift.y;
   }
   else {
-    xField = xshiftbase + globalShift.x;
-    yField = yshiftbase + globalShift.y;
+    add(xshiftbase, globalShift.x, ws.xField);
+    add(yshiftbase, globalShift.y, ws.yField);
   }
 
-  Mat imremap, normremap;
-  remap(image, imremap, xField, yField,
+  remap(image, ws.image, ws.xField, ws.yField,
         INTER_LINEAR, BORDER_CONSTANT, 0);
-  remap(normalizationMask, normremap, xField, yField,
+  remap(normalizationMask, ws.normalization, ws.xField, ws.yField,
         INTER_LINEAR, BORDER_CONSTANT, 0);
-  return std::pair<Mat, Mat>(imremap, normremap);
+  return std::pair<Mat, Mat>(ws.image, ws.normalization);
 }
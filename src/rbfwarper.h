@@ -30,11 +30,29 @@ public:
             const float sigma,
             const int supersampling = 1);
 
+  // Working buffers for warp(); each thread needs its own.
+  struct workspace {
+    cv::Mat1f weights;
+    cv::Mat xshiftPoints, yshiftPoints;
+    cv::Mat xshift, yshift;
+    cv::Mat xField, yField;
+    cv::Mat image, normalization;
+  };
+
   std::pair<cv::Mat, cv::Mat>
     warp(const cv::Mat& image,
-         const cv::Point& globalShift,
+         const cv::Point2f& globalShift,
          const cv::Mat1f& shifts = cv::Mat()) const;
 
+  // The same, but without allocating memory once the workspace has been
+  // used. The returned images are the workspace's buffers and are only
+  // valid until the next call.
+  std::pair<cv::Mat, cv::Mat>
+    warp(const cv::Mat& image,
+         const cv::Point2f& globalShift,
+         const cv::Mat1f& shifts,
+         workspace& ws) const;
+
 private:
   void gauss1d(float* ptr, const cv::Range& range, const float sigma) const;
   void prepareBases();
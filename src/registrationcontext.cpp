@@ -18,25 +18,41 @@
 
 #include <iostream>
 #include "registrationcontext.h"
+#include "statefile.h"
 
-inputImage::inputImage(std::string filename_) :
-  filename(filename_), globalShift(0, 0), globalMultiplier(1)
+inputImage::inputImage(std::string filename_, int frame_) :
+  filename(filename_), frame(frame_), globalShift(0, 0), globalMultiplier(1)
 {}
 
 
 inputImage::inputImage(const cv::FileNode& node) {
   node["filename"] >> filename;
+  if (node["frame"].isInt())
+    node["frame"] >> frame;
   node["globalShift"] >> globalShift;
   node["globalMultiplier"] >> globalMultiplier;
+  if (node["quality"].isReal() || node["quality"].isInt())
+    node["quality"] >> quality;
 }
 
 
 void inputImage::write(cv::FileStorage& fs) const {
   fs << "{"
-     << "filename" << filename
-     << "globalShift" << globalShift
-     << "globalMultiplier" << globalMultiplier
-     << "}";
+     << "filename" << filename;
+  if (frame >= 0)
+    fs << "frame" << frame;
+  fs << "globalShift" << globalShift
+     << "globalMultiplier" << globalMultiplier;
+  if (quality >= 0)
+    fs << "quality" << quality;
+  fs << "}";
+}
+
+
+std::string inputImage::name() const {
+  if (frame < 0)
+    return filename;
+  return filename + ":" + std::to_string(frame);
 }
 
 
@@ -45,13 +61,30 @@ void write(cv::FileStorage& fs, const cv::String&, const inputImage& image) {
 }
 
 
-registrationContext::registrationContext(const cv::FileStorage& fs) {
+registrationContext::registrationContext(const cv::FileStorage& fs,
+                                         const binaryArchiveReader* archive,
+                                         const int spectralDepth) {
+  if (archive)
+    backingFile = archive->mapping();
+
   if (!fs["imagesize"].empty()) {
     cv::Size new_imagesize;
     fs["imagesize"] >> new_imagesize;
     imagesize(new_imagesize);
   }
 
+  if (fs["imagechannels"].isInt()) {
+    int new_imagechannels;
+    fs["imagechannels"] >> new_imagechannels;
+    imagechannels(new_imagechannels);
+  }
+
+  if (fs["imagedepth"].isInt()) {
+    int new_imagedepth;
+    fs["imagedepth"] >> new_imagedepth;
+    imagedepth(new_imagedepth);
+  }
+
   if (fs["boxsize"].isInt()) {
     int new_boxsize;
     fs["boxsize"] >> new_boxsize;
@@ -66,7 +99,10 @@ registrationContext::registrationContext(const cv::FileStorage& fs) {
 
   if (! fs["refimg"].empty()) {
     cv::Mat new_refimg;
-    fs["refimg"] >> new_refimg;
+    if (archive && fs["refimg"].isInt())
+      new_refimg = archive->array(fs["refimg"]);
+    else
+      fs["refimg"] >> new_refimg;
     refimg(new_refimg);
   }
 
@@ -80,7 +116,8 @@ registrationContext::registrationContext(const cv::FileStorage& fs) {
   if (fs["patches"].isSeq() && ! fs["patchCreationArea"].empty()) {
     patchCollection new_patches;
     for (const auto& i : fs["patches"])
-      new_patches.push_back(imagePatch(refimg(), imagePatchPosition(i), boxsize()));
+      new_patches.push_back(imagePatch(refimg(), imagePatchPosition(i), boxsize(),
+                                       spectralDepth));
     fs["patchCreationArea"] >> new_patches.patchCreationArea;
     patches(new_patches);
   }
@@ -89,7 +126,10 @@ registrationContext::registrationContext(const cv::FileStorage& fs) {
     std::vector<cv::Mat1f> new_shifts;
     for (const auto& i : fs["shifts"]) {
       cv::Mat1f shifts;
-      i >> shifts;
+      if (archive && i.isInt())
+        shifts = archive->array(i);
+      else
+        i >> shifts;
       new_shifts.push_back(shifts);
     }
     shifts(new_shifts);
@@ -137,9 +177,14 @@ void write(cv::FileStorage& fs,
   fs << "patchCreationArea" << patches.patchCreationArea;
 }
 
-void registrationContext::write(cv::FileStorage& fs) const {
+void registrationContext::write(cv::FileStorage& fs,
+                                binaryArchiveWriter* archive) const {
   if (imagesize.valid())
     fs << "imagesize" << imagesize();
+  if (imagechannels.valid())
+    fs << "imagechannels" << imagechannels();
+  if (imagedepth.valid())
+    fs << "imagedepth" << imagedepth();
   if (boxsize.valid())
     fs << "boxsize" << boxsize();
   if (images.valid())
@@ -148,10 +193,22 @@ void registrationContext::write(cv::FileStorage& fs) const {
     fs << "commonRectangle" << commonRectangle();
   if (patches.valid())
     fs << "patches" << patches();
-  if (refimg.valid())
-    fs << "refimg" << refimg();
-  if (shifts.valid())
-    fs << "shifts" << shifts();
+  if (refimg.valid()) {
+    if (archive)
+      fs << "refimg" << archive->add(refimg());
+    else
+      fs << "refimg" << refimg();
+  }
+  if (shifts.valid()) {
+    if (archive) {
+      fs << "shifts" << "[";
+      for (const auto& s : shifts())
+        fs << archive->add(s);
+      fs << "]";
+    }
+    else
+      fs << "shifts" << shifts();
+  }
 }
 
 void write(cv::FileStorage& fs,
@@ -161,9 +218,15 @@ void write(cv::FileStorage& fs,
 }
 
 void registrationContext::printReport() const {
-  if (images.valid())
+  if (images.valid()) {
     std::cerr << "  * " << images().size() << " images ("
-      << imagesize().width << "x" << imagesize().height << ")\n";
+      << imagesize().width << "x" << imagesize().height;
+    if (imagechannels.valid())
+      std::cerr << ", " << imagechannels() << (imagechannels() > 1 ? " channels" : " channel");
+    if (imagedepth.valid())
+      std::cerr << ", " << imagedepth() << " bit";
+    std::cerr << ")\n";
+  }
   if (commonRectangle.valid())
     std::cerr << "  * global registration data\n";
   if (refimg.valid())
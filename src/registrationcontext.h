@@ -21,18 +21,30 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 #include <opencv2/core/core.hpp>
 #include "imagepatch.h"
 
+class mappedFile;
+class binaryArchiveReader;
+class binaryArchiveWriter;
+
 class inputImage {
 public:
-  inputImage(std::string filename_);
+  inputImage(std::string filename_, int frame_ = -1);
   inputImage(const cv::FileNode& node);
   void write(cv::FileStorage& fs) const;
+  // Human-readable identification of the image.
+  std::string name() const;
 
   std::string filename;
-  cv::Point globalShift;
+  // Index of the frame within a container file (such as SER); -1 if the
+  // file holds a single image.
+  int frame = -1;
+  cv::Point2f globalShift;
   float globalMultiplier;
+  // Sharpness of the image (higher is better); negative if not graded.
+  float quality = -1;
 };
 
 void write(cv::FileStorage& fs, const cv::String&, const inputImage& image);
@@ -68,11 +80,19 @@ private:
 class registrationContext {
 public:
   registrationContext() = default;
-  registrationContext(const cv::FileStorage& fs);
-  void write(cv::FileStorage& fs) const;
+  // If an archive is given, large arrays are taken from it rather than from
+  // the FileStorage (see statefile.h). The registration points are created
+  // with the given spectral depth (see imagePatch).
+  registrationContext(const cv::FileStorage& fs,
+                      const binaryArchiveReader* archive = nullptr,
+                      int spectralDepth = CV_64F);
+  void write(cv::FileStorage& fs, binaryArchiveWriter* archive = nullptr) const;
   void printReport() const;
 
   managed<cv::Size> imagesize;
+  managed<int> imagechannels;
+  // Bits per sample in the input files.
+  managed<int> imagedepth;
   managed<int> boxsize;
   managed<std::vector<inputImage>> images;
   managed<cv::Rect> commonRectangle;
@@ -87,6 +107,10 @@ public:
   // convenience methods
   cv::Rect refimgRectangle() const
     { return cv::Rect(cv::Point(0, 0), refimg().size()); }
+
+private:
+  // A memory-mapped state file that refimg and shifts may point into.
+  std::shared_ptr<const mappedFile> backingFile;
 };
 
 void write(cv::FileStorage& fs,
@@ -16,8 +16,13 @@
  *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <thread>
+#include <sstream>
+#include <stdexcept>
 #include <tclap/CmdLine.h>
+#include <opencv2/core/core.hpp>
 #include "registrationparams.h"
+#include "imageops.h"
 
 class naturalNumberConstraint : public TCLAP::Constraint<unsigned int>
 {
@@ -31,6 +36,50 @@ public:
 } nnConstraint;
 
 
+// State files are written either as YAML via OpenCV's FileStorage (we
+// insist on '.yml' so that the name says what is inside) or in our own
+// binary format. Extensions are matched case-insensitively, as in
+// isBinaryStateFile().
+static bool validStateFileName(const std::string& filename) {
+  return hasExtension(filename, ".yml") || hasExtension(filename, ".lyk");
+}
+
+
+// Parses "FILE[,percent=P][,super=S][,mono]"; returns false on errors.
+static bool parseOutputSpec(const std::string& text,
+                            registrationParams::outputSpec& spec) {
+  std::vector<std::string> fields;
+  std::istringstream stream(text);
+  std::string field;
+  while (std::getline(stream, field, ','))
+    fields.push_back(field);
+  if (fields.empty() || fields[0].empty())
+    return false;
+
+  spec.filename = fields[0];
+  for (size_t i = 1; i < fields.size(); i++) {
+    const std::string& f = fields[i];
+    const size_t eq = f.find('=');
+    const std::string key = f.substr(0, eq);
+    const std::string value = eq == std::string::npos ? "" : f.substr(eq + 1);
+    try {
+      if (key == "mono" && eq == std::string::npos)
+        spec.mono = true;
+      else if (key == "percent")
+        spec.percent = std::stof(value);
+      else if (key == "super")
+        spec.supersampling = std::stoi(value);
+      else
+        return false;
+    }
+    catch (std::logic_error&) {
+      return false;
+    }
+  }
+  return spec.percent > 0 && spec.percent <= 100 && spec.supersampling >= 1;
+}
+
+
 template <typename num_t>
 std::string defval(num_t d)
 {
@@ -54,11 +103,42 @@ bool registrationParams::parse(const int argc, const char* argv[])
     TCLAP::SwitchArg arg_prereg_on_middle(
       "2", "prereg-on-middle", "Preregister using the middle image as the reference.", false);
     cmd.add(arg_prereg_on_middle);
+    TCLAP::SwitchArg arg_prereg_centroid(
+      "", "prereg-centroid", "Preregister by aligning the brightness centroids of the "
+                             "images (fast; for a single bright object on a dark sky).", false);
+    cmd.add(arg_prereg_centroid);
     TCLAP::ValueArg<unsigned int> arg_prereg_maxmove(
       "x", "prereg-maxmove", "Maximum displacement in pre-registering. Zero means half "
                              "of the images' smallest size; this is also the default.",
                              false, prereg_maxmove, "pixels");
     cmd.add(arg_prereg_maxmove);
+    TCLAP::ValueArg<unsigned int> arg_prereg_pyramid(
+      "", "prereg-pyramid", "Pre-register quickly on images downsampled N times by "
+                            "a factor of two, then refine at full resolution. 2 or 3 "
+                            "speeds up large images considerably " + defval(prereg_pyramid),
+                            false, prereg_pyramid, "N");
+    cmd.add(arg_prereg_pyramid);
+    std::vector<std::string> preregEngines {"spectral", "matchtemplate"};
+    TCLAP::ValuesConstraint<std::string> preregEngineConstraint(preregEngines);
+    TCLAP::ValueArg<std::string> arg_prereg_engine(
+      "", "prereg-engine", "Correlation method for pre-registration: with precomputed "
+                           "spectra of the reference, or via OpenCV's matchTemplate "
+                           "(slower; default spectral).", false, "spectral",
+                           &preregEngineConstraint);
+    cmd.add(arg_prereg_engine);
+
+    // frame selection
+    TCLAP::SwitchArg arg_grade(
+      "g", "grade", "Grade the images by sharpness (before pre-registration).", grade);
+    cmd.add(arg_grade);
+    TCLAP::ValueArg<unsigned int> arg_keep_best(
+      "", "keep-best", "Only process the N sharpest images (requires graded images).",
+      false, keep_best, &nnConstraint);
+    cmd.add(arg_keep_best);
+    TCLAP::ValueArg<float> arg_keep_percent(
+      "", "keep-percent", "Only process the given percentage of the sharpest images "
+                          "(requires graded images).", false, keep_percent, "percent");
+    cmd.add(arg_keep_percent);
 
     // reference image
     TCLAP::SwitchArg arg_refimg(
@@ -87,6 +167,31 @@ bool registrationParams::parse(const int argc, const char* argv[])
     TCLAP::ValueArg<unsigned int> arg_maxmove(
       "m", "maxmove", "Maximum displacement in dedistortion " + defval(maxmove), false, maxmove, "pixels");
     cmd.add(arg_maxmove);
+    TCLAP::ValueArg<unsigned int> arg_dedistort_pyramid(
+      "", "dedistort-pyramid", "Match registration points on images downsampled N "
+                               "times by a factor of two first, then refine at full "
+                               "resolution in a small window. Speeds up large "
+                               "--maxmove values " + defval(dedistort_pyramid),
+                               false, dedistort_pyramid, "N");
+    cmd.add(arg_dedistort_pyramid);
+    TCLAP::SwitchArg arg_single_precision(
+      "", "single-precision", "Match registration points using single precision "
+                              "spectra (faster and needs half the memory, but is "
+                              "slightly less accurate; see --compare-precision).",
+                              single_precision);
+    cmd.add(arg_single_precision);
+    TCLAP::ValueArg<unsigned int> arg_compare_precision(
+      "", "compare-precision", "Dedistort the first N images with both single and "
+                               "double precision spectra, report the differences "
+                               "and the timing, and exit.", false,
+                               compare_precision, "N");
+    cmd.add(arg_compare_precision);
+    TCLAP::ValueArg<std::string> arg_wisdom(
+      "", "wisdom", "Choose the fastest method of matching registration points "
+                    "by timing the candidates on this machine, and remember the "
+                    "choice for the given boxsize and maxmove in this file.",
+                    false, "", "filename");
+    cmd.add(arg_wisdom);
 
     // interpolation + stacking
     TCLAP::SwitchArg arg_stack(
@@ -95,31 +200,99 @@ bool registrationParams::parse(const int argc, const char* argv[])
     TCLAP::ValueArg<unsigned int> arg_supersampling(
       "s", "super", "Supersampling " + defval(supersampling), false, supersampling, "N");
     cmd.add(arg_supersampling);
+    TCLAP::ValueArg<unsigned int> arg_time_budget(
+      "", "time-budget", "Stop dedistortion and stacking after this many seconds and "
+                         "save what has been done so far. Graded images are processed "
+                         "from the sharpest on.", false, time_budget, "seconds");
+    cmd.add(arg_time_budget);
+    TCLAP::ValueArg<unsigned int> arg_max_frames(
+      "", "max-frames", "Dedistort and stack at most this many images (the sharpest "
+                        "ones, if graded). The rest can be processed later with "
+                        "--resume if a --checkpoint is given.", false, max_frames, "N");
+    cmd.add(arg_max_frames);
 
     // input options
     TCLAP::ValueArg<std::string> arg_read_state(
-      "i", "read-state", "Continue processing from a saved state", false, "", "filename.yml");
+      "i", "read-state", "Continue processing from a saved state", false, "", "filename.yml|lyk");
     cmd.add(arg_read_state);
     TCLAP::UnlabeledMultiArg<std::string> arg_files(
-      "files", "Image files to process", false, "files");
+      "files", "Image files (or SER videos, FITS cubes) to process", false, "files");
     cmd.add(arg_files);
+    TCLAP::SwitchArg arg_append(
+      "", "append", "Add the listed files to the images from --read-state. Only the "
+                    "new images are pre-registered and dedistorted; existing "
+                    "results are reused.", append);
+    cmd.add(arg_append);
+    TCLAP::ValueArg<std::string> arg_frame_cache(
+      "", "frame-cache", "Keep decoded frames in this directory and reuse them "
+                         "in later stages and runs.", false, "", "directory");
+    cmd.add(arg_frame_cache);
+    std::vector<std::string> cacheFormats {"float", "half", "16bit"};
+    TCLAP::ValuesConstraint<std::string> cacheFormatConstraint(cacheFormats);
+    TCLAP::ValueArg<std::string> arg_frame_cache_format(
+      "", "frame-cache-format", "Sample format of cached frames (default float).",
+      false, "float", &cacheFormatConstraint);
+    cmd.add(arg_frame_cache_format);
+
+    // resource usage
+    TCLAP::ValueArg<unsigned int> arg_threads(
+      "", "threads", "Number of threads for computation in each processing stage. "
+                     "Zero means the number of processors; this is also the default.",
+                     false, threads, "N");
+    cmd.add(arg_threads);
+    TCLAP::ValueArg<unsigned int> arg_io_threads(
+      "", "io-threads", "Maximum number of images that are read and decoded at the same time "
+                        + defval(io_threads), false, io_threads, &nnConstraint);
+    cmd.add(arg_io_threads);
+    TCLAP::ValueArg<unsigned int> arg_read_ahead(
+      "", "read-ahead", "Maximum number of images waiting between processing stages. "
+                        "Zero means the number of computation threads; this is also "
+                        "the default.", false, read_ahead, "N");
+    cmd.add(arg_read_ahead);
+
+    // checkpoints
+    TCLAP::ValueArg<std::string> arg_checkpoint(
+      "", "checkpoint", "Periodically save the progress of dedistortion and stacking "
+                        "into this file.", false, "", "filename");
+    cmd.add(arg_checkpoint);
+    TCLAP::ValueArg<unsigned int> arg_checkpoint_interval(
+      "", "checkpoint-interval", "Time between checkpoints in seconds "
+                                 + defval(checkpoint_interval), false,
+                                 checkpoint_interval, &nnConstraint);
+    cmd.add(arg_checkpoint_interval);
+    TCLAP::SwitchArg arg_resume(
+      "", "resume", "Skip the images that were already processed according to "
+                    "the --checkpoint file, if it exists.", resume);
+    cmd.add(arg_resume);
 
     // output options
     TCLAP::ValueArg<std::string> arg_save_state(
-      "w", "save-state", "Save the registration state into a file", false, "", "filename.yml");
+      "w", "save-state", "Save the registration state into a file (YAML or, "
+                         "with the '.lyk' extension, a faster binary format)",
+                         false, "", "filename.yml|lyk");
     cmd.add(arg_save_state);
     TCLAP::ValueArg<std::string> arg_output_file(
-      "o", "output", "Output file", false, "", "filename");
+      "o", "output", "Output file (a FITS file receives unnormalized 32-bit "
+                   "float data)", false, "", "filename");
     cmd.add(arg_output_file);
+    TCLAP::MultiArg<std::string> arg_extra_output(
+      "", "extra-output", "Additionally stack into this file, in the same pass. "
+                          "Options can select a percentage of the sharpest images "
+                          "(requires graded images), supersampling and a mono "
+                          "output, e.g. 'best10.tif,percent=10,super=2,mono'. "
+                          "May be given multiple times.", false,
+                          "filename[,options]");
+    cmd.add(arg_extra_output);
 
     cmd.parse(argc, argv);
 
     // stages
     if (arg_prereg_img.isSet() +
         arg_prereg_on_first.isSet() +
-        arg_prereg_on_middle.isSet() > 1) {
-      std::cerr << "ERROR: arguments --prereg-img, --prereg-on-first and\n"
-                << "       --prereg-on-middle are mutually exclusive!" << std::endl;
+        arg_prereg_on_middle.isSet() +
+        arg_prereg_centroid.isSet() > 1) {
+      std::cerr << "ERROR: arguments --prereg-img, --prereg-on-first,\n"
+                << "       --prereg-on-middle and --prereg-centroid are mutually exclusive!" << std::endl;
       return false;
     }
     if (arg_prereg_img.isSet()) {
@@ -130,6 +303,8 @@ bool registrationParams::parse(const int argc, const char* argv[])
       prereg = preregType::FirstImage;
     else if (arg_prereg_on_middle.isSet())
       prereg = preregType::MiddleImage;
+    else if (arg_prereg_centroid.isSet())
+      prereg = preregType::Centroid;
 
     if (prereg != preregType::None)
       stage_prereg = true;
@@ -145,27 +320,68 @@ bool registrationParams::parse(const int argc, const char* argv[])
       return false;
     }
 
+    grade = arg_grade.isSet();
+    if (arg_keep_best.isSet() && arg_keep_percent.isSet()) {
+      std::cerr << "ERROR: --keep-best and --keep-percent are mutually exclusive." << std::endl;
+      return false;
+    }
+    keep_best = arg_keep_best.getValue();
+    keep_percent = arg_keep_percent.getValue();
+    if (arg_keep_percent.isSet() && !(keep_percent > 0 && keep_percent <= 100)) {
+      std::cerr << "ERROR: --keep-percent must be larger than 0 and at most 100." << std::endl;
+      return false;
+    }
+
     prereg_maxmove = arg_prereg_maxmove.getValue();
+    prereg_pyramid = arg_prereg_pyramid.getValue();
+    if (arg_prereg_engine.getValue() == "matchtemplate")
+      prereg_engine = preregEngineType::MatchTemplate;
     boxsize_override = arg_boxsize.isSet();
     boxsize = arg_boxsize.getValue();
     crop = arg_crop.isSet();
     maxmove = arg_maxmove.getValue();
+    dedistort_pyramid = arg_dedistort_pyramid.getValue();
+    single_precision = arg_single_precision.isSet();
+    compare_precision = arg_compare_precision.getValue();
+    wisdom_file = arg_wisdom.getValue();
+    if (compare_precision > 0 && (only_refimg || stage_dedistort || stage_stack)) {
+      std::cerr << "ERROR: --compare-precision can not be combined with --only-refimg,\n"
+                   "       --dedistort or --stack." << std::endl;
+      return false;
+    }
     supersampling = arg_supersampling.getValue();
+    time_budget = arg_time_budget.getValue();
+    max_frames = arg_max_frames.getValue();
+    threads = arg_threads.getValue();
+    io_threads = arg_io_threads.getValue();
+    read_ahead = arg_read_ahead.getValue();
 
-    if (arg_read_state.isSet() && arg_files.isSet()) {
-      std::cerr << "ERROR: you can either use --read-state OR list input files." << std::endl;
+    append = arg_append.isSet();
+    if (append) {
+      if (!arg_read_state.isSet() || !arg_files.isSet()) {
+        std::cerr << "ERROR: --append requires both --read-state and a list of input files." << std::endl;
+        return false;
+      }
+      if (stage_prereg) {
+        std::cerr << "ERROR: --append can not be combined with pre-registration options\n"
+                     "       (appended images are pre-registered automatically)." << std::endl;
+        return false;
+      }
+    }
+    else if (arg_read_state.isSet() && arg_files.isSet()) {
+      std::cerr << "ERROR: you can either use --read-state OR list input files\n"
+                   "       (or add files to a state with --append)." << std::endl;
       return false;
     }
     if (arg_read_state.isSet()) {
       read_state_file = arg_read_state.getValue();
-      if (read_state_file.length() >= 4 &&
-          std::string(read_state_file.cend()-4, read_state_file.cend()) != ".yml") {
+      if (!validStateFileName(read_state_file)) {
         std::cerr << "ERROR: --read-state requires a file name ending in '.yml'\n"
-                     "       (sorry - an OpenCV peculiarity; can't do much about that)\n";
+                     "       (YAML) or '.lyk' (binary)\n";
         return false;
       }
     }
-    else {
+    if (!arg_read_state.isSet() || append) {
       files = arg_files.getValue();
       if (files.size() == 0) {
         std::cerr << "ERROR: No input files given\n";
@@ -173,12 +389,29 @@ bool registrationParams::parse(const int argc, const char* argv[])
       }
     }
 
+    checkpoint_file = arg_checkpoint.getValue();
+    checkpoint_interval = arg_checkpoint_interval.getValue();
+    resume = arg_resume.isSet();
+    if (resume && checkpoint_file.empty()) {
+      std::cerr << "ERROR: --resume requires a --checkpoint file." << std::endl;
+      return false;
+    }
+    if (!checkpoint_file.empty() && !(stage_dedistort || stage_stack)) {
+      std::cerr << "ERROR: checkpoints are only written during dedistortion and stacking." << std::endl;
+      return false;
+    }
+
+    frame_cache = arg_frame_cache.getValue();
+    if (arg_frame_cache_format.getValue() == "half")
+      frame_cache_storage = cacheStorage::Half;
+    else if (arg_frame_cache_format.getValue() == "16bit")
+      frame_cache_storage = cacheStorage::UInt16;
+
     if (arg_save_state.isSet()) {
       save_state_file = arg_save_state.getValue();
-      if (save_state_file.length() >= 4 &&
-          std::string(save_state_file.cend()-4, save_state_file.cend()) != ".yml") {
+      if (!validStateFileName(save_state_file)) {
         std::cerr << "ERROR: --save-state requires a file name ending in '.yml'\n"
-                     "       (sorry - an OpenCV peculiarity; can't do much about that)\n";
+                     "       (YAML) or '.lyk' (binary)\n";
         return false;
       }
     }
@@ -196,12 +429,25 @@ bool registrationParams::parse(const int argc, const char* argv[])
                      "       Refusing to discard the result.\n";
         return false;
       }
-      else if (!arg_save_state.isSet()) {
+      else if (!arg_save_state.isSet() && compare_precision == 0) {
         std::cerr << "ERROR: no destination file specified with --save-state.\n"
                      "       Refusing to discard data.\n";
         return false;
       }
     }
+
+    for (const auto& text : arg_extra_output.getValue()) {
+      if (!stage_stack) {
+        std::cerr << "ERROR: --extra-output requires --stack." << std::endl;
+        return false;
+      }
+      outputSpec spec;
+      if (!parseOutputSpec(text, spec)) {
+        std::cerr << "ERROR: invalid --extra-output '" << text << "'." << std::endl;
+        return false;
+      }
+      extra_outputs.push_back(spec);
+    }
   }
   catch (TCLAP::ArgException &e)
   {
@@ -210,3 +456,37 @@ bool registrationParams::parse(const int argc, const char* argv[])
   }
   return true;
 }
+
+
+std::vector<registrationParams::outputSpec> registrationParams::outputs() const {
+  outputSpec main;
+  main.filename = output_file;
+  main.supersampling = supersampling;
+  std::vector<outputSpec> all {main};
+  all.insert(all.end(), extra_outputs.begin(), extra_outputs.end());
+  return all;
+}
+
+
+int registrationParams::computeThreads() const {
+  if (threads > 0)
+    return threads;
+  return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+
+int registrationParams::ioThreads() const {
+  return io_threads;
+}
+
+
+int registrationParams::readAhead() const {
+  if (read_ahead > 0)
+    return read_ahead;
+  return computeThreads();
+}
+
+
+int registrationParams::spectralDepth() const {
+  return single_precision ? CV_32F : CV_64F;
+}
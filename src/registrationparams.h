@@ -27,6 +27,26 @@ class registrationParams
 public:
   bool parse(const int argc, const char *argv[]);
 
+  // An image produced by stacking: the given percentage of the sharpest
+  // images, stacked with the given supersampling, in color or mono.
+  struct outputSpec {
+    std::string filename;
+    float percent = 100;
+    int supersampling = 1;
+    bool mono = false;
+  };
+
+  // All stacked outputs: the main one (output_file) and the extra ones.
+  std::vector<outputSpec> outputs() const;
+
+  // Worker pool sizes for the processing pipelines, with defaults resolved.
+  int computeThreads() const;
+  int ioThreads() const;
+  int readAhead() const;
+
+  // Depth of the spectra of registration points (see imagePatch).
+  int spectralDepth() const;
+
   bool stage_prereg = false;
   bool stage_refimg = false;
   bool stage_patches = false;
@@ -34,10 +54,20 @@ public:
   bool stage_stack = false;
 
   // global registration
-  enum class preregType { None, ExplicitImage, FirstImage, MiddleImage }
+  enum class preregType { None, ExplicitImage, FirstImage, MiddleImage, Centroid }
     prereg = preregType::None;
   std::string prereg_img;
   unsigned int prereg_maxmove = 0;
+  // Number of halvings of the image size for the coarse pre-registration
+  // step; 0 disables the coarse step.
+  unsigned int prereg_pyramid = 0;
+  enum class preregEngineType { MatchTemplate, Spectral }
+    prereg_engine = preregEngineType::Spectral;
+
+  // frame selection
+  bool grade = false;
+  unsigned int keep_best = 0;
+  float keep_percent = 0;
 
   // reference image + registration points
   bool only_refimg = false;
@@ -47,17 +77,46 @@ public:
 
   // dedistortion
   unsigned int maxmove = 20;
+  // Number of halvings of the image size for the coarse matching step; 0
+  // disables the coarse step.
+  unsigned int dedistort_pyramid = 0;
+  // Single precision spectra for patch matching.
+  bool single_precision = false;
+  // Number of images for comparing single and double precision; 0 disables
+  // the comparison.
+  unsigned int compare_precision = 0;
+  // Where to keep the choices of the correlation method; empty disables
+  // autotuning.
+  std::string wisdom_file;
 
   // interpolation + stacking
   int supersampling = 1;
+  // Limits for dedistortion and stacking; 0 means no limit.
+  unsigned int time_budget = 0;
+  unsigned int max_frames = 0;
 
   // input options
   std::string read_state_file;
   std::vector<std::string> files;
+  // Add files to the images from read_state_file instead of replacing them.
+  bool append = false;
+  std::string frame_cache;
+  enum class cacheStorage { Float, Half, UInt16 } frame_cache_storage = cacheStorage::Float;
+
+  // resource usage
+  unsigned int threads = 0;
+  unsigned int io_threads = 2;
+  unsigned int read_ahead = 0;
+
+  // checkpoints
+  std::string checkpoint_file;
+  unsigned int checkpoint_interval = 300;
+  bool resume = false;
 
   // output options
   std::string save_state_file;
   std::string output_file;
+  std::vector<outputSpec> extra_outputs;
 };
 
 #endif // REGISTRATIONPARAMS_H
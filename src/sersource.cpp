@@ -0,0 +1,139 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "sersource.h"
+
+using namespace cv;
+
+namespace {
+  const size_t headerSize = 178;
+
+  enum serColorID {
+    MONO = 0,
+    BAYER_RGGB = 8,
+    BAYER_GRBG = 9,
+    BAYER_GBRG = 10,
+    BAYER_BGGR = 11,
+    RGB = 100,
+    BGR = 101
+  };
+
+  // Header fields are always little endian.
+  int32_t headerInt(const unsigned char* header, int offset) {
+    const unsigned char* p = header + offset;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+}
+
+
+serSource::serSource(const std::string& filename) : file(filename) {
+  const unsigned char* header = file.data();
+  if (file.size() < headerSize || std::memcmp(header, "LUCAM-RECORDER", 14) != 0)
+    throw std::runtime_error("'" + filename + "' is not a SER file");
+
+  colorID = headerInt(header, 18);
+  // The SER specification says that a value of zero denotes big-endian data,
+  // but virtually all capture software writes little-endian data with this
+  // field set to zero. We follow the software rather than the specification.
+  bigEndian = headerInt(header, 22) != 0;
+  width = headerInt(header, 26);
+  height = headerInt(header, 30);
+  bitDepth = headerInt(header, 34);
+  frames = headerInt(header, 38);
+
+  switch (colorID) {
+    case MONO:
+    case BAYER_RGGB:
+    case BAYER_GRBG:
+    case BAYER_GBRG:
+    case BAYER_BGGR:
+      planes = 1; break;
+    case RGB:
+    case BGR:
+      planes = 3; break;
+    default:
+      throw std::runtime_error("'" + filename + "': unsupported SER color format " +
+                               std::to_string(colorID));
+  }
+
+  if (width <= 0 || height <= 0 || bitDepth < 1 || bitDepth > 16 || frames < 0)
+    throw std::runtime_error("'" + filename + "': corrupt SER header");
+
+  frameBytes = (size_t)width * height * planes * (bitDepth > 8 ? 2 : 1);
+
+  // Captures that were interrupted often leave a truncated file behind. Use
+  // as many frames as there actually are.
+  const size_t available = (file.size() - headerSize) / frameBytes;
+  if (available < (size_t)frames) {
+    std::cerr << "WARNING: '" << filename << "' is truncated; using "
+              << available << " of " << frames << " frames\n";
+    frames = available;
+  }
+}
+
+
+Mat serSource::read(int frame) const {
+  if (frame < 0 || frame >= frames)
+    throw std::out_of_range("SER frame index " + std::to_string(frame) + " out of range");
+
+  const int depth = bitDepth > 8 ? CV_16U : CV_8U;
+  Mat raw(height, width, CV_MAKETYPE(depth, planes),
+          file.data() + headerSize + frame*frameBytes);
+
+  if (depth == CV_16U && bigEndian) {
+    Mat swapped(raw.size(), raw.type());
+    const uint16_t* src = raw.ptr<uint16_t>(0);
+    uint16_t* dst = swapped.ptr<uint16_t>(0);
+    for (size_t i = 0; i < raw.total()*planes; i++)
+      dst[i] = (src[i] >> 8) | (src[i] << 8);
+    raw = swapped;
+  }
+
+  int conversion = -1;
+  switch (colorID) {
+    // OpenCV names Bayer patterns after the second row of the mosaic.
+    case BAYER_RGGB: conversion = COLOR_BayerBG2BGR; break;
+    case BAYER_GRBG: conversion = COLOR_BayerGB2BGR; break;
+    case BAYER_GBRG: conversion = COLOR_BayerGR2BGR; break;
+    case BAYER_BGGR: conversion = COLOR_BayerRG2BGR; break;
+    case RGB: conversion = COLOR_RGB2BGR; break;
+  }
+
+  Mat pixels = raw;
+  if (conversion >= 0)
+    cvtColor(raw, pixels, conversion);
+
+  Mat output;
+  pixels.convertTo(output, CV_MAKETYPE(CV_32F, pixels.channels()),
+                   1.0/((1 << bitDepth) - 1));
+  return output;
+}
+
+
+frameInfo serSource::probe(int) const {
+  frameInfo info;
+  info.size = Size(width, height);
+  info.channels = colorID == MONO ? 1 : 3;
+  info.bitDepth = bitDepth;
+  return info;
+}
@@ -0,0 +1,52 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERSOURCE_H
+#define SERSOURCE_H
+
+#include "framesource.h"
+#include "mappedfile.h"
+
+// Reader for SER video files, as written by most planetary capture software.
+// The file is memory mapped and frames are converted straight from the
+// mapping, without intermediate copies.
+//
+// SER frames hold raw sensor data, so (unlike images read via ImageMagick)
+// they are taken to be linear already. Bayer-encoded frames are demosaiced.
+class serSource : public frameSource {
+public:
+  serSource(const std::string& filename);
+
+  int frameCount() const { return frames; }
+  bool container() const { return true; }
+  cv::Mat read(int frame) const;
+  frameInfo probe(int frame) const;
+
+private:
+  mappedFile file;
+  int colorID;
+  int width;
+  int height;
+  int bitDepth;
+  int planes;
+  bool bigEndian;
+  int frames;
+  size_t frameBytes;
+};
+
+#endif // SERSOURCE_H
@@ -0,0 +1,199 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include "statefile.h"
+#include "imageops.h"
+
+using namespace cv;
+
+namespace {
+  const char magic[8] = {'L', 'Y', 'K', 'S', 'T', 'A', 'T', 'E'};
+  const uint32_t version = 1;
+  const size_t alignment = 64;
+
+  struct fileHeader {
+    uint32_t version;
+    uint32_t arrayCount;
+    uint64_t metadataOffset;
+    uint64_t metadataLength;
+  };
+
+  struct arrayEntry {
+    int32_t type;
+    int32_t rows;
+    int32_t cols;
+    int32_t reserved;
+    uint64_t offset;
+  };
+
+  size_t align(size_t offset) {
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  void requireLittleEndian() {
+    const uint16_t probe = 1;
+    if (*reinterpret_cast<const uint8_t*>(&probe) != 1)
+      throw std::runtime_error("binary state files are only supported on little-endian machines");
+  }
+}
+
+
+int binaryArchiveWriter::add(const Mat& array) {
+  CV_Assert(array.dims <= 2);
+  arrays.push_back(array);
+  return arrays.size() - 1;
+}
+
+
+void binaryArchiveWriter::write(const std::string& filename, const std::string& metadata) const {
+  requireLittleEndian();
+
+  fileHeader header;
+  header.version = version;
+  header.arrayCount = arrays.size();
+  header.metadataOffset = sizeof(magic) + sizeof(header) + arrays.size()*sizeof(arrayEntry);
+  header.metadataLength = metadata.size();
+
+  std::vector<arrayEntry> table(arrays.size());
+  size_t offset = align(header.metadataOffset + header.metadataLength);
+  for (size_t i = 0; i < arrays.size(); i++) {
+    table[i].type = arrays[i].type();
+    table[i].rows = arrays[i].rows;
+    table[i].cols = arrays[i].cols;
+    table[i].reserved = 0;
+    table[i].offset = offset;
+    offset = align(offset + arrays[i].total()*arrays[i].elemSize());
+  }
+
+  std::ofstream out(filename, std::ios::binary);
+  out.write(magic, sizeof(magic));
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(table.data()), table.size()*sizeof(arrayEntry));
+  out.write(metadata.data(), metadata.size());
+  for (size_t i = 0; i < arrays.size(); i++) {
+    const size_t padding = table[i].offset - (size_t)out.tellp();
+    out.write(std::string(padding, '\0').data(), padding);
+    const size_t rowBytes = arrays[i].cols*arrays[i].elemSize();
+    for (int row = 0; row < arrays[i].rows; row++)
+      out.write(reinterpret_cast<const char*>(arrays[i].ptr(row)), rowBytes);
+  }
+  out.close();
+  if (!out)
+    throw std::runtime_error("error writing '" + filename + "'");
+}
+
+
+binaryArchiveReader::binaryArchiveReader(const std::string& filename) :
+  file(std::make_shared<mappedFile>(filename))
+{
+  requireLittleEndian();
+
+  const unsigned char* data = file->data();
+  fileHeader header;
+  if (file->size() < sizeof(magic) + sizeof(header) ||
+      std::memcmp(data, magic, sizeof(magic)) != 0)
+    throw std::runtime_error("'" + filename + "' is not a lycklig state file");
+  std::memcpy(&header, data + sizeof(magic), sizeof(header));
+  if (header.version != version)
+    throw std::runtime_error("'" + filename + "': unsupported state file version");
+
+  const size_t tableOffset = sizeof(magic) + sizeof(header);
+  if (file->size() < tableOffset + header.arrayCount*sizeof(arrayEntry) ||
+      file->size() < header.metadataOffset ||
+      file->size() - header.metadataOffset < header.metadataLength)
+    throw std::runtime_error("'" + filename + "': truncated state file");
+
+  meta.assign(reinterpret_cast<const char*>(data + header.metadataOffset),
+              header.metadataLength);
+
+  for (uint32_t i = 0; i < header.arrayCount; i++) {
+    arrayEntry entry;
+    std::memcpy(&entry, data + tableOffset + i*sizeof(arrayEntry), sizeof(entry));
+    // Check the entry before a Mat is made of it; the sizes are compared so
+    // that nothing can overflow.
+    if (entry.rows < 0 || entry.cols < 0 ||
+        entry.type != CV_MAT_TYPE(entry.type) || CV_MAT_DEPTH(entry.type) > CV_64F)
+      throw std::runtime_error("'" + filename + "': corrupt state file");
+    const size_t total = (size_t)entry.rows * (size_t)entry.cols;
+    const size_t elemSize = CV_ELEM_SIZE(entry.type);
+    if (entry.offset > file->size() ||
+        total > (file->size() - entry.offset) / elemSize)
+      throw std::runtime_error("'" + filename + "': corrupt state file");
+    arrays.push_back(Mat(entry.rows, entry.cols, entry.type,
+                         file->data() + entry.offset));
+  }
+}
+
+
+Mat binaryArchiveReader::array(int index) const {
+  return arrays.at(index);
+}
+
+
+bool isBinaryStateFile(const std::string& filename) {
+  return hasExtension(filename, ".lyk");
+}
+
+
+registrationContext readStateFile(const std::string& filename,
+                                  const int spectralDepth) {
+  if (isBinaryStateFile(filename)) {
+    binaryArchiveReader archive(filename);
+    FileStorage fs(archive.metadata(), FileStorage::READ | FileStorage::MEMORY);
+    return registrationContext(fs, &archive, spectralDepth);
+  }
+  else {
+    FileStorage fs(filename, FileStorage::READ);
+    return registrationContext(fs, nullptr, spectralDepth);
+  }
+}
+
+
+void writeStateFile(const std::string& filename, const registrationContext& context) {
+  if (isBinaryStateFile(filename)) {
+    binaryArchiveWriter archive;
+    FileStorage fs(".yml", FileStorage::WRITE | FileStorage::MEMORY);
+    context.write(fs, &archive);
+    // The context may still point into the file that is being replaced
+    // (see readStateFile()), so the old file must stay intact until the
+    // new one is complete.
+    const std::string tmp = filename + ".tmp";
+    try {
+      archive.write(tmp, fs.releaseAndGetString());
+    }
+    catch (...) {
+      std::remove(tmp.c_str());
+      throw;
+    }
+    if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("can not replace state file '" + filename + "'");
+    }
+  }
+  else {
+    // The format is given explicitly so that it does not depend on how
+    // FileStorage interprets the (possibly upper case) extension.
+    FileStorage fs(filename, FileStorage::WRITE | FileStorage::FORMAT_YAML);
+    context.write(fs);
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATEFILE_H
+#define STATEFILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <opencv2/core/core.hpp>
+#include "mappedfile.h"
+#include "registrationcontext.h"
+
+// Binary state files hold the same metadata as YAML state files (serialized
+// as YAML), but large arrays, such as the reference image and dedistortion
+// shifts, are stored separately in raw form. Metadata refer to arrays by
+// their index. The file is laid out as
+//
+//   magic          8 bytes, "LYKSTATE"
+//   version        uint32
+//   array count    uint32
+//   metadata       uint64 offset, uint64 length
+//   array table    for each array: int32 type, rows, cols, reserved;
+//                  uint64 offset
+//   metadata       YAML text
+//   arrays         raw little-endian data, each aligned to 64 bytes
+//
+// so that the arrays can be used directly from a memory-mapped file.
+class binaryArchiveWriter {
+public:
+  // Adds an array to the archive and returns its index.
+  int add(const cv::Mat& array);
+  void write(const std::string& filename, const std::string& metadata) const;
+
+private:
+  std::vector<cv::Mat> arrays;
+};
+
+
+class binaryArchiveReader {
+public:
+  binaryArchiveReader(const std::string& filename);
+
+  const std::string& metadata() const { return meta; }
+  // The returned matrix points into the mapped file, which is kept alive by
+  // mapping() - see registrationContext::backingFile.
+  cv::Mat array(int index) const;
+  std::shared_ptr<const mappedFile> mapping() const { return file; }
+
+private:
+  std::shared_ptr<const mappedFile> file;
+  std::string meta;
+  std::vector<cv::Mat> arrays;
+};
+
+
+bool isBinaryStateFile(const std::string& filename);
+
+// Read or write a state file in the format given by the file name extension:
+// '.lyk' for binary, '.yml' for YAML. The registration points are read with
+// the given spectral depth (see imagePatch).
+registrationContext readStateFile(const std::string& filename,
+                                  int spectralDepth = CV_64F);
+void writeStateFile(const std::string& filename, const registrationContext& context);
+
+#endif // STATEFILE_H
@@ -0,0 +1,92 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include "tiledaccumulator.h"
+
+using namespace cv;
+
+tiledAccumulator::tiledAccumulator(const Size size, const int channels,
+                                   const int tileRows_) :
+  sumPlane(Mat::zeros(size, CV_MAKETYPE(CV_32F, channels))),
+  normalizationPlane(Mat::zeros(size, CV_32F)),
+  tileRows(tileRows_),
+  tileLocks((size.height + tileRows_ - 1) / tileRows_),
+  nextTile(0) {}
+
+
+void tiledAccumulator::add(const Mat& image, const Mat& weight,
+                           const double weightScale, const Point offset)
+{
+  CV_Assert(image.type() == sumPlane.type());
+  CV_Assert(weight.empty() || (weight.type() == CV_32F && weight.size() == image.size()));
+  const Rect target(offset, image.size());
+  CV_Assert((target & Rect(Point(0, 0), sumPlane.size())) == target);
+
+  // Tiles covered by the image, visited in a rotated order.
+  const int firstTile = target.y / tileRows;
+  const int lastTile = (target.br().y - 1) / tileRows;
+  const int tileCount = lastTile - firstTile + 1;
+  const int start = tileCount > 0 ? nextTile++ % tileCount : 0;
+  for (int i = 0; i < tileCount; i++) {
+    const int tile = firstTile + (start + i) % tileCount;
+    const int top = std::max(tile * tileRows, target.y);
+    const int bottom = std::min((tile + 1) * tileRows, target.br().y);
+    const Rect rows(target.x, top, target.width, bottom - top);
+    const Rect sourceRows = rows - offset;
+
+    std::lock_guard<std::mutex> lock(tileLocks[tile]);
+    accumulate(image(sourceRows), sumPlane(rows));
+    Mat normalizationRows(normalizationPlane(rows));
+    if (weight.empty())
+      normalizationRows += weightScale;
+    else
+      scaleAdd(weight(sourceRows), weightScale, normalizationRows, normalizationRows);
+  }
+}
+
+
+snapshotGate::updateScope::updateScope(snapshotGate& gate_) :
+  gate(gate_)
+{
+  std::unique_lock<std::mutex> lock(gate.lock);
+  gate.changed.wait(lock, [this]() { return !gate.frozen; });
+  gate.inflight++;
+}
+
+
+snapshotGate::updateScope::~updateScope()
+{
+  std::lock_guard<std::mutex> lock(gate.lock);
+  if (--gate.inflight == 0)
+    gate.changed.notify_all();
+}
+
+
+void snapshotGate::freeze(const std::function<void()>& whileFrozen)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  changed.wait(guard, [this]() { return !frozen; });
+  frozen = true;
+  changed.wait(guard, [this]() { return inflight == 0; });
+
+  whileFrozen();
+
+  frozen = false;
+  changed.notify_all();
+}
@@ -0,0 +1,87 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILEDACCUMULATOR_H
+#define TILEDACCUMULATOR_H
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <opencv2/core/core.hpp>
+
+// A sum of images together with a normalization plane (the sum of their
+// weights), to which any number of threads can add at the same time.
+//
+// The planes are split into horizontal tiles, each with its own lock. A
+// thread adding an image locks one tile at a time, starting at a different
+// tile than the previous caller, so concurrent additions mostly proceed in
+// parallel. Memory use does not depend on the number of threads.
+class tiledAccumulator {
+public:
+  tiledAccumulator(const cv::Size size, const int channels, const int tileRows = 32);
+
+  // Adds image to the sum and weight, multiplied by weightScale, to the
+  // normalization, with the top left corner at offset. An empty weight
+  // stands for a plane of ones.
+  void add(const cv::Mat& image, const cv::Mat& weight, const double weightScale,
+           const cv::Point offset = cv::Point(0, 0));
+
+  // Direct access; only when no additions can be in progress (see
+  // snapshotGate).
+  cv::Mat& sum() { return sumPlane; }
+  cv::Mat& normalization() { return normalizationPlane; }
+
+private:
+  cv::Mat sumPlane;
+  cv::Mat normalizationPlane;
+  int tileRows;
+  std::vector<std::mutex> tileLocks;
+  std::atomic<unsigned> nextTile;
+};
+
+
+// Lets one thread look at a consistent state of data (such as a set of
+// accumulators and the list of images they contain) that other threads keep
+// updating. Each update is done within the lifetime of an updateScope;
+// freeze() waits for the updates in progress to finish and holds back new
+// ones while it calls the given function.
+class snapshotGate {
+public:
+  class updateScope {
+  public:
+    updateScope(snapshotGate& gate);
+    ~updateScope();
+    updateScope(const updateScope&) = delete;
+    updateScope& operator=(const updateScope&) = delete;
+
+  private:
+    snapshotGate& gate;
+  };
+
+  void freeze(const std::function<void()>& whileFrozen);
+
+private:
+  std::mutex lock;
+  std::condition_variable changed;
+  bool frozen = false;
+  int inflight = 0;
+};
+
+#endif // TILEDACCUMULATOR_H
@@ -0,0 +1,169 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include "xcorwisdom.h"
+
+using namespace cv;
+
+std::unique_ptr<xcorWisdom> xcorWisdom::globalWisdom;
+
+
+xcorWisdom::xcorWisdom(const std::string& filename_) :
+  filename(filename_)
+{
+  if (!std::ifstream(filename).good())
+    return;
+
+  // The wisdom is merely an optimization; a file that can't be read is
+  // reported and otherwise ignored.
+  try {
+    FileStorage fs(filename, FileStorage::READ);
+    for (const auto& node : fs["wisdom"]) {
+      entry e;
+      node["templSize"] >> e.templSize;
+      node["searchSize"] >> e.searchSize;
+      node["spectralDepth"] >> e.spectralDepth;
+      std::string engine;
+      node["engine"] >> engine;
+      if (engine == "direct")
+        e.options.engine = xcorOptions::engineType::Direct;
+      node["blockScale"] >> e.options.blockScale;
+      node["minBlockSize"] >> e.options.minBlockSize;
+      entries.push_back(e);
+    }
+  }
+  catch (std::exception& e) {
+    std::cerr << "WARNING: could not read wisdom from '" << filename << "': "
+              << e.what() << "\n";
+    entries.clear();
+  }
+}
+
+
+void xcorWisdom::enable(const std::string& filename) {
+  globalWisdom.reset(new xcorWisdom(filename));
+}
+
+
+xcorOptions xcorWisdom::options(const Size templSize, const Size searchSize,
+                                const int spectralDepth) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (const auto& e : entries)
+    if (e.templSize == templSize && e.searchSize == searchSize &&
+        e.spectralDepth == spectralDepth)
+      return e.options;
+
+  entry e;
+  e.templSize = templSize;
+  e.searchSize = searchSize;
+  e.spectralDepth = spectralDepth;
+  e.options = tune(templSize, searchSize, spectralDepth);
+  entries.push_back(e);
+  save();
+  return e.options;
+}
+
+
+// Times cookedTemplate::match() with each of the candidate options on
+// random data of the given geometry and returns the fastest ones.
+xcorOptions xcorWisdom::tune(const Size templSize, const Size searchSize,
+                             const int spectralDepth) {
+  typedef xcorOptions::engineType engineType;
+  std::vector<xcorOptions> candidates;
+  xcorOptions direct;
+  direct.engine = engineType::Direct;
+  candidates.push_back(direct);
+  for (const double blockScale : {2.0, 3.0, 4.5, 6.0}) {
+    for (const int minBlockSize : {128, 256}) {
+      xcorOptions fft;
+      fft.blockScale = blockScale;
+      fft.minBlockSize = minBlockSize;
+      candidates.push_back(fft);
+    }
+  }
+
+  Mat1f templ(templSize), img(searchSize), result;
+  randu(templ, 0, 1);
+  randu(img, 0, 1);
+  xcorWorkspace workspace;
+
+  typedef std::chrono::steady_clock clock;
+  const auto minDuration = std::chrono::milliseconds(20);
+  const int minRepetitions = 3;
+
+  std::cerr << "Timing correlation methods for " << templSize.width << "x"
+            << templSize.height << " templates in " << searchSize.width << "x"
+            << searchSize.height << " search areas... ";
+  xcorOptions best;
+  double bestTime = std::numeric_limits<double>::max();
+  for (const auto& candidate : candidates) {
+    const cookedTemplate cooked(templ, searchSize, spectralDepth, candidate);
+    // warm-up (allocates the workspace)
+    cooked.match(img, result, workspace);
+
+    int repetitions = 0;
+    const auto start = clock::now();
+    clock::duration elapsed;
+    do {
+      cooked.match(img, result, workspace);
+      repetitions++;
+      elapsed = clock::now() - start;
+    } while (elapsed < minDuration || repetitions < minRepetitions);
+
+    const double time = std::chrono::duration<double>(elapsed).count() / repetitions;
+    if (time < bestTime) {
+      bestTime = time;
+      best = candidate;
+    }
+  }
+
+  if (best.engine == engineType::Direct)
+    std::cerr << "direct\n";
+  else
+    std::cerr << "FFT (block scale " << best.blockScale << ", minimum block size "
+              << best.minBlockSize << ")\n";
+  return best;
+}
+
+
+void xcorWisdom::save() const {
+  try {
+    FileStorage fs(filename, FileStorage::WRITE | FileStorage::FORMAT_YAML);
+    fs << "wisdom" << "[";
+    for (const auto& e : entries) {
+      fs << "{"
+         << "templSize" << e.templSize
+         << "searchSize" << e.searchSize
+         << "spectralDepth" << e.spectralDepth
+         << "engine" << (e.options.engine == xcorOptions::engineType::Direct ?
+                         "direct" : "fft")
+         << "blockScale" << e.options.blockScale
+         << "minBlockSize" << e.options.minBlockSize
+         << "}";
+    }
+    fs << "]";
+  }
+  catch (std::exception& e) {
+    std::cerr << "WARNING: could not save wisdom to '" << filename << "': "
+              << e.what() << "\n";
+  }
+}
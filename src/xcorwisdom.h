@@ -0,0 +1,63 @@
+/*
+ *    lycklig, image processing for lucky imaging.
+ *    Copyright (C) 2013, 2014 Andrej Lajovic <andrej.lajovic@ad-vega.si>
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 3 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef XCORWISDOM_H
+#define XCORWISDOM_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <opencv2/core/core.hpp>
+#include "cookedtemplate.h"
+
+// Remembers which xcorOptions are fastest for a given geometry (template
+// size, search area size and spectral depth) on this machine. Geometries
+// that are not in the wisdom file yet are timed with all candidate options
+// when first needed, and the file is updated with the result.
+class xcorWisdom {
+public:
+  xcorWisdom(const std::string& filename);
+
+  // Thread safe; other threads wait while a geometry is being timed.
+  xcorOptions options(cv::Size templSize, cv::Size searchSize, int spectralDepth);
+
+  // Global wisdom used for the templates of registration points. Should be
+  // enabled before any patches are matched.
+  static void enable(const std::string& filename);
+  static xcorWisdom* instance() { return globalWisdom.get(); }
+
+private:
+  struct entry {
+    cv::Size templSize;
+    cv::Size searchSize;
+    int spectralDepth;
+    xcorOptions options;
+  };
+
+  static xcorOptions tune(cv::Size templSize, cv::Size searchSize, int spectralDepth);
+  void save() const;
+
+  const std::string filename;
+  std::mutex lock;
+  std::vector<entry> entries;
+
+  static std::unique_ptr<xcorWisdom> globalWisdom;
+};
+
+#endif // XCORWISDOM_H